@@ -0,0 +1,174 @@
+#ifndef BVH_H
+#define BVH_H
+#include <vector>
+#include <algorithm>
+#include "vec3.h"
+#include "ray.h"
+#include "aabb.h"
+#include "triangle.h"
+
+
+//Triangle BVH for occlusion queries.
+//Nodes are stored depth first, so children always come after their parent and refit can run back to front.
+class BVH {
+    public:
+        static constexpr int MAX_LEAF = 4;
+        static constexpr int MAX_MIDPOINT_DEPTH = 32;
+        static constexpr int STACK_SIZE = 128;
+
+        struct Node {
+            AABB bounds;
+            int parent;
+            int left;
+            int right;
+            int first;
+            int count;
+
+            bool isLeaf() const {
+                return count > 0;
+            };
+        };
+
+        std::vector<Node> nodes;
+        std::vector<int> indices;
+        std::vector<int> leafOf;
+
+        BVH() {};
+
+
+        void build(const std::vector<Vec3>& vertices, const std::vector<Triangle>& triangles) {
+            nodes.clear();
+            indices.resize(triangles.size());
+            leafOf.resize(triangles.size());
+            for(int i = 0; i < triangles.size(); i++) {
+                indices[i] = i;
+            }
+            if(triangles.empty()) return;
+
+            std::vector<Vec3> centroids(triangles.size());
+            for(int i = 0; i < triangles.size(); i++) {
+                const Triangle& t = triangles[i];
+                centroids[i] = (vertices[t.v0] + vertices[t.v1] + vertices[t.v2])/3.0f;
+            }
+            buildNode(vertices, triangles, centroids, 0, triangles.size(), -1, 0);
+        };
+
+
+        AABB bounds() const {
+            return nodes.empty() ? AABB() : nodes[0].bounds;
+        };
+        AABB leafBounds(int triangleID) const {
+            return nodes[leafOf[triangleID]].bounds;
+        };
+
+
+        //update bounds after the triangles in `modified` moved, topology is kept
+        void refit(const std::vector<Vec3>& vertices, const std::vector<Triangle>& triangles, const std::vector<int>& modified) {
+            std::vector<char> dirty(nodes.size(), 0);
+            for(int i = 0; i < modified.size(); i++) {
+                for(int n = leafOf[modified[i]]; n != -1 && !dirty[n]; n = nodes[n].parent) {
+                    dirty[n] = 1;
+                }
+            }
+
+            for(int n = nodes.size() - 1; n >= 0; n--) {
+                if(!dirty[n]) continue;
+                Node& node = nodes[n];
+                if(node.isLeaf()) {
+                    node.bounds = triangleBounds(vertices, triangles, node.first, node.count);
+                }
+                else {
+                    node.bounds = mergeAABB(nodes[node.left].bounds, nodes[node.right].bounds);
+                }
+            }
+        };
+
+
+        //any hit, triangles sharing ignoreVertex are skipped
+        bool intersect(const Ray& ray, const std::vector<Vec3>& vertices, const std::vector<Triangle>& triangles, int ignoreVertex = -1) const {
+            if(nodes.empty()) return false;
+
+            const Vec3 invDir = 1.0f/ray.direction;
+            const int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+
+            int stack[STACK_SIZE];
+            int sp = 0;
+            stack[sp++] = 0;
+            while(sp > 0) {
+                const Node& node = nodes[stack[--sp]];
+                if(!node.bounds.intersect(ray, invDir, dirIsNeg)) continue;
+
+                if(node.isLeaf()) {
+                    for(int i = node.first; i < node.first + node.count; i++) {
+                        const Triangle& t = triangles[indices[i]];
+                        if(ignoreVertex == t.v0 || ignoreVertex == t.v1 || ignoreVertex == t.v2) continue;
+                        if(RayTriangleIntersection(ray, vertices[t.v0], vertices[t.v1], vertices[t.v2])) {
+                            return true;
+                        }
+                    }
+                }
+                else {
+                    stack[sp++] = node.left;
+                    stack[sp++] = node.right;
+                }
+            }
+            return false;
+        };
+
+    private:
+        AABB triangleBounds(const std::vector<Vec3>& vertices, const std::vector<Triangle>& triangles, int first, int count) const {
+            AABB b;
+            for(int i = first; i < first + count; i++) {
+                const Triangle& t = triangles[indices[i]];
+                b = mergeAABB(b, vertices[t.v0]);
+                b = mergeAABB(b, vertices[t.v1]);
+                b = mergeAABB(b, vertices[t.v2]);
+            }
+            return b;
+        };
+
+        int buildNode(const std::vector<Vec3>& vertices, const std::vector<Triangle>& triangles, const std::vector<Vec3>& centroids, int first, int last, int parent, int depth) {
+            const int id = nodes.size();
+            nodes.push_back(Node());
+            nodes[id].parent = parent;
+            nodes[id].bounds = triangleBounds(vertices, triangles, first, last - first);
+
+            AABB centroidBounds;
+            for(int i = first; i < last; i++) {
+                centroidBounds = mergeAABB(centroidBounds, centroids[indices[i]]);
+            }
+            const int axis = maximumExtent(centroidBounds);
+            const float extent = centroidBounds.pMax[axis] - centroidBounds.pMin[axis];
+
+            if(last - first <= MAX_LEAF || extent <= 0.0f) {
+                nodes[id].left = nodes[id].right = -1;
+                nodes[id].first = first;
+                nodes[id].count = last - first;
+                for(int i = first; i < last; i++) {
+                    leafOf[indices[i]] = id;
+                }
+                return id;
+            }
+
+            //split at the centroid midpoint, fall back to the median when one side is empty or the tree gets deep
+            const float mid = 0.5f*(centroidBounds.pMin[axis] + centroidBounds.pMax[axis]);
+            int split = std::partition(indices.begin() + first, indices.begin() + last, [&](int i) {
+                return centroids[i][axis] < mid;
+            }) - indices.begin();
+            if(split == first || split == last || depth >= MAX_MIDPOINT_DEPTH) {
+                split = (first + last)/2;
+                std::nth_element(indices.begin() + first, indices.begin() + split, indices.begin() + last, [&](int a, int b) {
+                    return centroids[a][axis] < centroids[b][axis];
+                });
+            }
+
+            const int left = buildNode(vertices, triangles, centroids, first, split, id, depth + 1);
+            const int right = buildNode(vertices, triangles, centroids, split, last, id, depth + 1);
+            nodes[id].left = left;
+            nodes[id].right = right;
+            nodes[id].first = 0;
+            nodes[id].count = 0;
+            return id;
+        };
+};
+#endif
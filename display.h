@@ -0,0 +1,195 @@
+#ifndef DISPLAY_H
+#define DISPLAY_H
+#include <vector>
+#include <cstring>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+#ifndef GL_GLEXT_PROTOTYPES
+#define GL_GLEXT_PROTOTYPES
+#endif
+#include <GL/gl.h>
+
+#include "vec3.h"
+#include "triangle.h"
+#include "transfer.h"
+
+
+//Mesh kept in vertex buffer objects, only colors are uploaded after construction.
+//Needs a current GL context, buffer objects are GL 1.5 so Mesa's software rasterizers have them.
+class DisplayMesh {
+    public:
+        GLuint positionBuffer;
+        GLuint colorBuffer;
+        GLuint indexBuffer;
+        int vertices_n;
+        int indices_n;
+
+        DisplayMesh(const std::vector<Vec3>& vertices, const std::vector<Triangle>& triangles, float scale) {
+            vertices_n = vertices.size();
+            indices_n = 3*triangles.size();
+
+            std::vector<float> positions(3*vertices_n);
+            for(int i = 0; i < vertices_n; i++) {
+                positions[3*i] = scale*vertices[i].x;
+                positions[3*i + 1] = scale*vertices[i].y;
+                positions[3*i + 2] = scale*vertices[i].z;
+            }
+            std::vector<GLuint> indices(indices_n);
+            for(int i = 0; i < triangles.size(); i++) {
+                indices[3*i] = triangles[i].v0;
+                indices[3*i + 1] = triangles[i].v1;
+                indices[3*i + 2] = triangles[i].v2;
+            }
+
+            glGenBuffers(1, &positionBuffer);
+            glBindBuffer(GL_ARRAY_BUFFER, positionBuffer);
+            glBufferData(GL_ARRAY_BUFFER, positions.size()*sizeof(float), positions.data(), GL_STATIC_DRAW);
+
+            glGenBuffers(1, &colorBuffer);
+            glBindBuffer(GL_ARRAY_BUFFER, colorBuffer);
+            glBufferData(GL_ARRAY_BUFFER, 3*vertices_n*sizeof(float), nullptr, GL_STREAM_DRAW);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+            glGenBuffers(1, &indexBuffer);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size()*sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+        };
+        ~DisplayMesh() {
+            glDeleteBuffers(1, &positionBuffer);
+            glDeleteBuffers(1, &colorBuffer);
+            glDeleteBuffers(1, &indexBuffer);
+        };
+
+        DisplayMesh(const DisplayMesh&) = delete;
+        DisplayMesh& operator=(const DisplayMesh&) = delete;
+
+
+        void updateColors(const float* rgb) {
+            glBindBuffer(GL_ARRAY_BUFFER, colorBuffer);
+            glBufferSubData(GL_ARRAY_BUFFER, 0, 3*vertices_n*sizeof(float), rgb);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+        };
+
+        void draw() const {
+            glEnableClientState(GL_VERTEX_ARRAY);
+            glEnableClientState(GL_COLOR_ARRAY);
+
+            glBindBuffer(GL_ARRAY_BUFFER, positionBuffer);
+            glVertexPointer(3, GL_FLOAT, 0, nullptr);
+            glBindBuffer(GL_ARRAY_BUFFER, colorBuffer);
+            glColorPointer(3, GL_FLOAT, 0, nullptr);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+            glDrawElements(GL_TRIANGLES, indices_n, GL_UNSIGNED_INT, nullptr);
+
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+            glDisableClientState(GL_COLOR_ARRAY);
+            glDisableClientState(GL_VERTEX_ARRAY);
+        };
+};
+
+
+//Shades vertex colors on a worker thread one frame ahead of the renderer.
+//light(frame, skyCoeffs) fills the sky coefficients of a frame, it runs on the worker thread.
+class ShadingPipeline {
+    public:
+        typedef std::function<void(int, Vec3*)> LightFunction;
+
+        ShadingPipeline(const TransferStore& _coeffs, LightFunction _light) : coeffs(_coeffs), light(_light) {
+            const int n = coeffs.bands*coeffs.bands;
+            skyCoeffs.resize(n);
+            lastSkyCoeffs.resize(n);
+            for(int i = 0; i < 2; i++) {
+                colors[i].resize(3*coeffs.vertices_n);
+                changed[i] = true;
+            }
+            worker = std::thread(&ShadingPipeline::run, this);
+        };
+        ~ShadingPipeline() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+            }
+            requestCondition.notify_one();
+            worker.join();
+        };
+
+        ShadingPipeline(const ShadingPipeline&) = delete;
+        ShadingPipeline& operator=(const ShadingPipeline&) = delete;
+
+
+        //colors of the next frame, then the worker starts on the frame after it.
+        //the returned buffer stays valid until the next call. changed is false when the lighting did not change,
+        //the colors of the previous frame are still correct then and the buffer must not be read.
+        const float* acquire(bool& isChanged) {
+            std::unique_lock<std::mutex> lock(mutex);
+            doneCondition.wait(lock, [&] { return finished == frame; });
+            const float* result = colors[frame%2].data();
+            isChanged = changed[frame%2];
+
+            frame++;
+            requested = frame;
+            lock.unlock();
+            requestCondition.notify_one();
+            return result;
+        };
+
+    private:
+        const TransferStore& coeffs;
+        LightFunction light;
+        std::vector<Vec3> skyCoeffs;
+        std::vector<Vec3> lastSkyCoeffs;
+        std::vector<float> colors[2];
+        bool changed[2];
+
+        std::thread worker;
+        std::mutex mutex;
+        std::condition_variable requestCondition;
+        std::condition_variable doneCondition;
+        int frame = 0;
+        int requested = 0;
+        int finished = -1;
+        bool stop = false;
+
+        void run() {
+            for(int f = 0; ; f++) {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    requestCondition.wait(lock, [&] { return stop || requested >= f; });
+                    if(stop) return;
+                }
+                shade(f);
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    finished = f;
+                }
+                doneCondition.notify_one();
+            }
+        };
+
+        void shade(int f) {
+            light(f, skyCoeffs.data());
+            const size_t skyBytes = skyCoeffs.size()*sizeof(Vec3);
+            changed[f%2] = f == 0 || std::memcmp(skyCoeffs.data(), lastSkyCoeffs.data(), skyBytes) != 0;
+            if(!changed[f%2]) return;
+            std::memcpy(lastSkyCoeffs.data(), skyCoeffs.data(), skyBytes);
+
+            float* rgb = colors[f%2].data();
+            const Vec3* sky = skyCoeffs.data();
+            //same block to thread mapping as the projection, each thread reads the coefficients it touched first
+#pragma omp parallel for schedule(static, 1)
+            for(int b = 0; b < coeffs.blocks_n; b++) {
+                for(int i = coeffs.blockBegin(b); i < coeffs.blockEnd(b); i++) {
+                    Vec3 c = coeffs.shade(i, sky);
+                    rgb[3*i] = c.x;
+                    rgb[3*i + 1] = c.y;
+                    rgb[3*i + 2] = c.z;
+                }
+            }
+        };
+};
+#endif
@@ -0,0 +1,274 @@
+#ifndef HEMICUBE_H
+#define HEMICUBE_H
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+#include "vec3.h"
+#include "aabb.h"
+#include "triangle.h"
+#include "bvh.h"
+
+
+//Coverage cube map around a point, drawn with a small CPU rasterizer.
+//The cube is world axis aligned so a sample direction maps to the same texel for every vertex,
+//and only triangles reaching above the tangent plane are drawn, which makes it a hemicube in practice.
+class HemiCube {
+    public:
+        int res;
+        std::vector<unsigned char> coverage;
+
+        //needed are the texels read back with covered(), see setNeeded
+        HemiCube(int _res, const std::vector<int>& needed) : res(_res) {
+            coverage.resize(6*res*res);
+            setNeeded(needed);
+        };
+
+
+        //face is 2*axis + (negative ? 1 : 0), the other two axes are the image plane
+        static int texelOf(const Vec3& dir, int res) {
+            const float ax = std::abs(dir.x);
+            const float ay = std::abs(dir.y);
+            const float az = std::abs(dir.z);
+            const int axis = ax >= ay && ax >= az ? 0 : (ay >= az ? 1 : 2);
+            const float d = std::abs(dir[axis]);
+            const int face = 2*axis + (dir[axis] < 0 ? 1 : 0);
+
+            const float s = dir[(axis + 1)%3]/d;
+            const float t = dir[(axis + 2)%3]/d;
+            const int x = std::min(std::max((int)((s*0.5f + 0.5f)*res), 0), res - 1);
+            const int y = std::min(std::max((int)((t*0.5f + 0.5f)*res), 0), res - 1);
+            return face*res*res + y*res + x;
+        };
+
+
+        bool covered(int texel) const {
+            return coverage[texel] != 0;
+        };
+
+
+        //only these texels are read back, coverage elsewhere is left out.
+        //they are kept as sorted x per face row, the rasterizer only evaluates those pixels
+        void setNeeded(const std::vector<int>& texels) {
+            std::vector<unsigned char> needed(6*res*res, 0);
+            for(int i = 0; i < texels.size(); i++) {
+                needed[texels[i]] = 1;
+            }
+            rowStart.assign(6*res + 1, 0);
+            rowX.clear();
+            for(int row = 0; row < 6*res; row++) {
+                rowStart[row] = rowX.size();
+                for(int x = 0; x < res; x++) {
+                    if(needed[row*res + x]) rowX.push_back(x);
+                }
+            }
+            rowStart[6*res] = rowX.size();
+        };
+
+
+        //draw every triangle which does not use ignoreVertex as seen from origin.
+        //bvh is walked near to far, nodes below the tangent plane or whose footprint has no needed texel left uncovered
+        //are skipped, which gives the same coverage at needed texels as drawing every triangle.
+        void render(const Vec3& origin, const Vec3& normal, const std::vector<Vec3>& vertices, const std::vector<Triangle>& triangles, const BVH& bvh, int ignoreVertex) {
+            std::memset(coverage.data(), 0, coverage.size());
+            if(bvh.nodes.empty()) return;
+
+            int stack[BVH::STACK_SIZE];
+            int sp = 0;
+            stack[sp++] = 0;
+            while(sp > 0) {
+                const BVH::Node& node = bvh.nodes[stack[--sp]];
+                const AABB b(node.bounds.pMin - origin, node.bounds.pMax - origin);
+                if(!aboveTangentPlane(b, normal)) continue;
+                const int faces = facesOf(b);
+                if(faces == 0 || footprintCovered(b, faces)) continue;
+
+                if(node.isLeaf()) {
+                    for(int i = node.first; i < node.first + node.count; i++) {
+                        drawTriangle(origin, normal, vertices, triangles[bvh.indices[i]], faces, ignoreVertex);
+                    }
+                }
+                else {
+                    //push the far child first so the near one is drawn first and covers more
+                    const AABB& l = bvh.nodes[node.left].bounds;
+                    const AABB& r = bvh.nodes[node.right].bounds;
+                    const bool leftNear = (0.5f*(l.pMin + l.pMax) - origin).length() < (0.5f*(r.pMin + r.pMax) - origin).length();
+                    stack[sp++] = leftNear ? node.right : node.left;
+                    stack[sp++] = leftNear ? node.left : node.right;
+                }
+            }
+        };
+
+    private:
+        static constexpr float NEAR = 1e-5f;
+
+        //needed texels, x of row (face*res + y) are rowX[rowStart[row], rowStart[row + 1])
+        std::vector<int> rowStart;
+        std::vector<int> rowX;
+
+        struct FaceVertex {
+            float s;
+            float t;
+            float d;
+        };
+
+        void drawTriangle(const Vec3& origin, const Vec3& normal, const std::vector<Vec3>& vertices, const Triangle& t, int faces, int ignoreVertex) {
+            if(ignoreVertex == t.v0 || ignoreVertex == t.v1 || ignoreVertex == t.v2) return;
+
+            //triangle setup is shared by all six faces
+            const Vec3 a = vertices[t.v0] - origin;
+            const Vec3 b = vertices[t.v1] - origin;
+            const Vec3 c = vertices[t.v2] - origin;
+            if(dot(a, normal) <= 0 && dot(b, normal) <= 0 && dot(c, normal) <= 0) return;
+
+            for(int face = 0; face < 6; face++) {
+                if(faces & (1 << face)) rasterize(face, a, b, c);
+            }
+        };
+
+
+        //b is relative to the cube center from here on
+        static bool aboveTangentPlane(const AABB& b, const Vec3& normal) {
+            for(int c = 0; c < 8; c++) {
+                if(dot(Vec3(b[c & 1].x, b[(c >> 1) & 1].y, b[(c >> 2) & 1].z), normal) > 0) return true;
+            }
+            return false;
+        };
+
+        //bit mask of the faces whose frustum b can reach, every side plane is tested on its own so it is conservative
+        static int facesOf(const AABB& b) {
+            int mask = 0;
+            for(int face = 0; face < 6; face++) {
+                const int axis = face/2;
+                const int sa = (axis + 1)%3;
+                const int ta = (axis + 2)%3;
+                const float dMax = face%2 == 0 ? b.pMax[axis] : -b.pMin[axis];
+                if(dMax <= NEAR) continue;
+                if(b.pMin[sa] > dMax || -b.pMax[sa] > dMax || b.pMin[ta] > dMax || -b.pMax[ta] > dMax) continue;
+                mask |= 1 << face;
+            }
+            return mask;
+        };
+
+        //true when every needed pixel the rasterizer could set for anything inside b is set on every face in faces
+        bool footprintCovered(const AABB& b, int faces) const {
+            for(int face = 0; face < 6; face++) {
+                if(!(faces & (1 << face))) continue;
+
+                float xmin = res, xmax = 0, ymin = res, ymax = 0;
+                for(int c = 0; c < 8; c++) {
+                    const FaceVertex v = toFace(face, Vec3(b[c & 1].x, b[(c >> 1) & 1].y, b[(c >> 2) & 1].z));
+                    //near plane crossings would need clipping, just draw the node
+                    if(v.d <= NEAR) return false;
+                    const float x = (v.s/v.d*0.5f + 0.5f)*res;
+                    const float y = (v.t/v.d*0.5f + 0.5f)*res;
+                    xmin = std::min(xmin, x);
+                    xmax = std::max(xmax, x);
+                    ymin = std::min(ymin, y);
+                    ymax = std::max(ymax, y);
+                }
+
+                //same pixel range as rasterizeTriangle
+                const int x0 = (int)std::max(std::floor(xmin), 0.0f);
+                const int x1 = (int)std::min(std::ceil(xmax), res - 1.0f);
+                const int y0 = (int)std::max(std::floor(ymin), 0.0f);
+                const int y1 = (int)std::min(std::ceil(ymax), res - 1.0f);
+                const unsigned char* image = coverage.data() + face*res*res;
+                for(int py = y0; py <= y1; py++) {
+                    const int row = face*res + py;
+                    for(int i = firstInRow(row, x0); i < rowStart[row + 1] && rowX[i] <= x1; i++) {
+                        if(!image[py*res + rowX[i]]) return false;
+                    }
+                }
+            }
+            return true;
+        };
+
+
+        static FaceVertex toFace(int face, const Vec3& p) {
+            const int axis = face/2;
+            const float sign = face%2 == 0 ? 1.0f : -1.0f;
+            FaceVertex v;
+            v.s = p[(axis + 1)%3];
+            v.t = p[(axis + 2)%3];
+            v.d = sign*p[axis];
+            return v;
+        };
+
+
+        void rasterize(int face, const Vec3& a, const Vec3& b, const Vec3& c) {
+            FaceVertex in[3] = {toFace(face, a), toFace(face, b), toFace(face, c)};
+
+            //reject against the four side planes and the near plane
+            bool outside[5] = {true, true, true, true, true};
+            for(int i = 0; i < 3; i++) {
+                outside[0] = outside[0] && in[i].s > in[i].d;
+                outside[1] = outside[1] && -in[i].s > in[i].d;
+                outside[2] = outside[2] && in[i].t > in[i].d;
+                outside[3] = outside[3] && -in[i].t > in[i].d;
+                outside[4] = outside[4] && in[i].d <= NEAR;
+            }
+            for(int i = 0; i < 5; i++) {
+                if(outside[i]) return;
+            }
+
+            //clip against the near plane, at most one extra vertex
+            FaceVertex poly[4];
+            int n = 0;
+            for(int i = 0; i < 3; i++) {
+                const FaceVertex& p = in[i];
+                const FaceVertex& q = in[(i + 1)%3];
+                if(p.d > NEAR) poly[n++] = p;
+                if((p.d > NEAR) != (q.d > NEAR)) {
+                    const float k = (NEAR - p.d)/(q.d - p.d);
+                    poly[n++] = {p.s + k*(q.s - p.s), p.t + k*(q.t - p.t), NEAR};
+                }
+            }
+
+            float x[4];
+            float y[4];
+            for(int i = 0; i < n; i++) {
+                x[i] = (poly[i].s/poly[i].d*0.5f + 0.5f)*res;
+                y[i] = (poly[i].t/poly[i].d*0.5f + 0.5f)*res;
+            }
+            for(int i = 1; i + 1 < n; i++) {
+                rasterizeTriangle(face, x[0], y[0], x[i], y[i], x[i + 1], y[i + 1]);
+            }
+        };
+
+
+        int firstInRow(int row, int x) const {
+            return std::lower_bound(rowX.begin() + rowStart[row], rowX.begin() + rowStart[row + 1], x) - rowX.begin();
+        };
+
+
+        //coverage at the centers of needed pixels with edge functions
+        void rasterizeTriangle(int face, float x0, float y0, float x1, float y1, float x2, float y2) {
+            const float area = (x1 - x0)*(y2 - y0) - (y1 - y0)*(x2 - x0);
+            if(area == 0.0f) return;
+            const float sign = area > 0 ? 1.0f : -1.0f;
+
+            //clamp in float first, projected vertices close to the near plane are far off screen
+            const int xmin = (int)std::max(std::floor(std::min(x0, std::min(x1, x2))), 0.0f);
+            const int xmax = (int)std::min(std::ceil(std::max(x0, std::max(x1, x2))), res - 1.0f);
+            const int ymin = (int)std::max(std::floor(std::min(y0, std::min(y1, y2))), 0.0f);
+            const int ymax = (int)std::min(std::ceil(std::max(y0, std::max(y1, y2))), res - 1.0f);
+
+            unsigned char* image = coverage.data() + face*res*res;
+            for(int py = ymin; py <= ymax; py++) {
+                const float cy = py + 0.5f;
+                const int row = face*res + py;
+                for(int i = firstInRow(row, xmin); i < rowStart[row + 1] && rowX[i] <= xmax; i++) {
+                    const int px = rowX[i];
+                    const float cx = px + 0.5f;
+                    const float w0 = sign*((x1 - x0)*(cy - y0) - (y1 - y0)*(cx - x0));
+                    const float w1 = sign*((x2 - x1)*(cy - y1) - (y2 - y1)*(cx - x1));
+                    const float w2 = sign*((x0 - x2)*(cy - y2) - (y0 - y2)*(cx - x2));
+                    if(w0 >= 0 && w1 >= 0 && w2 >= 0) {
+                        image[py*res + px] = 1;
+                    }
+                }
+            }
+        };
+};
+#endif
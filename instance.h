@@ -0,0 +1,205 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cmath>
+#include "vec3.h"
+#include "ray.h"
+#include "aabb.h"
+#include "scene.h"
+
+
+//Uniform scale, then rotation about the y axis, then translation.
+//Rotating about y keeps shared transfer usable, it only needs sph_rotate_y.
+struct Transform {
+    float scale;
+    float yaw;
+    Vec3 translation;
+
+    Transform() : scale(1.0f), yaw(0.0f) {};
+    Transform(const Vec3& translation, float yaw, float scale) : scale(scale), yaw(yaw), translation(translation) {};
+
+    //yaw increases the azimuth phi = atan2(z, x)
+    static Vec3 rotate(const Vec3& v, float angle) {
+        const float c = std::cos(angle);
+        const float s = std::sin(angle);
+        return Vec3(c*v.x - s*v.z, v.y, s*v.x + c*v.z);
+    };
+
+    Vec3 point(const Vec3& p) const {
+        return rotate(scale*p, yaw) + translation;
+    };
+    Vec3 vector(const Vec3& v) const {
+        return rotate(v, yaw);
+    };
+    Vec3 inversePoint(const Vec3& p) const {
+        return rotate(p - translation, -yaw)/scale;
+    };
+    Vec3 inverseVector(const Vec3& v) const {
+        return rotate(v, -yaw);
+    };
+
+    AABB bounds(const AABB& b) const {
+        AABB result;
+        for(int i = 0; i < 8; i++) {
+            result = mergeAABB(result, point(Vec3(b[i & 1].x, b[(i >> 1) & 1].y, b[(i >> 2) & 1].z)));
+        }
+        return result;
+    };
+};
+
+
+struct Instance {
+    int mesh;
+    Transform transform;
+    AABB bounds;
+
+    Instance() {};
+    Instance(int mesh, const Transform& transform) : mesh(mesh), transform(transform) {};
+};
+
+
+//Meshes placed by instances. Every mesh keeps one BVH in its own space (bottom level),
+//instance bounds go into a second BVH (top level) used to find instances which can shadow each other.
+class InstancedScene {
+    public:
+        std::vector<Scene> meshes;
+        std::vector<Instance> instances;
+        std::vector<std::vector<int>> neighbours;
+
+        InstancedScene() {};
+
+
+        int addMesh(const Scene& mesh) {
+            meshes.push_back(mesh);
+            return meshes.size() - 1;
+        };
+        int addInstance(int mesh, const Transform& transform) {
+            instances.push_back(Instance(mesh, transform));
+            return instances.size() - 1;
+        };
+
+
+        //instances A and B are neighbours of each other when their bounds come within interaction times the larger
+        //of their two diagonals, so a small instance still sees the shadow of a large one next to it.
+        //interaction < 0 makes every pair interact.
+        void build(float interaction = 1.0f) {
+            for(int i = 0; i < meshes.size(); i++) {
+                meshes[i].bvh.build(meshes[i].vertices, meshes[i].triangles);
+            }
+            for(int i = 0; i < instances.size(); i++) {
+                Instance& instance = instances[i];
+                instance.bounds = instance.transform.bounds(meshes[instance.mesh].bvh.bounds());
+            }
+            buildTopLevel();
+
+            neighbours.assign(instances.size(), std::vector<int>());
+            for(int i = 0; i < instances.size(); i++) {
+                const AABB& b = instances[i].bounds;
+                if(interaction < 0) {
+                    for(int j = 0; j < instances.size(); j++) {
+                        if(j != i) neighbours[i].push_back(j);
+                    }
+                    continue;
+                }
+                const float margin = interaction*(b.pMax - b.pMin).length();
+                const AABB query(b.pMin - margin, b.pMax + margin);
+                overlapping(query, 0, i, neighbours[i]);
+            }
+            if(interaction < 0) return;
+
+            //each query used its own diagonal, adding the reverse pairs gives the larger of the two
+            std::vector<std::vector<int>> reverse(instances.size());
+            for(int i = 0; i < instances.size(); i++) {
+                for(int k = 0; k < neighbours[i].size(); k++) {
+                    reverse[neighbours[i][k]].push_back(i);
+                }
+            }
+            for(int i = 0; i < instances.size(); i++) {
+                neighbours[i].insert(neighbours[i].end(), reverse[i].begin(), reverse[i].end());
+                std::sort(neighbours[i].begin(), neighbours[i].end());
+                neighbours[i].erase(std::unique(neighbours[i].begin(), neighbours[i].end()), neighbours[i].end());
+            }
+        };
+
+
+        //ray in world space against the neighbours of instance i
+        bool occludedByNeighbours(int i, const Ray& ray) const {
+            const std::vector<int>& list = neighbours[i];
+            for(int k = 0; k < list.size(); k++) {
+                const Instance& other = instances[list[k]];
+                if(!other.bounds.intersect(ray)) continue;
+                const Ray local(other.transform.inversePoint(ray.origin), other.transform.inverseVector(ray.direction));
+                const Scene& mesh = meshes[other.mesh];
+                if(mesh.bvh.intersect(local, mesh.vertices, mesh.triangles)) {
+                    return true;
+                }
+            }
+            return false;
+        };
+
+    private:
+        struct Node {
+            AABB bounds;
+            int left;
+            int right;
+            int instance;
+        };
+        std::vector<Node> topLevel;
+
+        void buildTopLevel() {
+            topLevel.clear();
+            std::vector<int> ids(instances.size());
+            for(int i = 0; i < ids.size(); i++) {
+                ids[i] = i;
+            }
+            if(!ids.empty()) buildNode(ids, 0, ids.size());
+        };
+        int buildNode(std::vector<int>& ids, int first, int last) {
+            const int id = topLevel.size();
+            topLevel.push_back(Node());
+            if(last - first == 1) {
+                topLevel[id].bounds = instances[ids[first]].bounds;
+                topLevel[id].left = topLevel[id].right = -1;
+                topLevel[id].instance = ids[first];
+                return id;
+            }
+
+            AABB centroids;
+            for(int i = first; i < last; i++) {
+                const AABB& b = instances[ids[i]].bounds;
+                centroids = mergeAABB(centroids, 0.5f*(b.pMin + b.pMax));
+            }
+            const int axis = maximumExtent(centroids);
+            const int mid = (first + last)/2;
+            std::nth_element(ids.begin() + first, ids.begin() + mid, ids.begin() + last, [&](int a, int b) {
+                return instances[a].bounds.pMin[axis] + instances[a].bounds.pMax[axis] < instances[b].bounds.pMin[axis] + instances[b].bounds.pMax[axis];
+            });
+
+            const int left = buildNode(ids, first, mid);
+            const int right = buildNode(ids, mid, last);
+            topLevel[id].bounds = mergeAABB(topLevel[left].bounds, topLevel[right].bounds);
+            topLevel[id].left = left;
+            topLevel[id].right = right;
+            topLevel[id].instance = -1;
+            return id;
+        };
+
+        static bool overlap(const AABB& a, const AABB& b) {
+            return a.pMin.x <= b.pMax.x && b.pMin.x <= a.pMax.x &&
+                a.pMin.y <= b.pMax.y && b.pMin.y <= a.pMax.y &&
+                a.pMin.z <= b.pMax.z && b.pMin.z <= a.pMax.z;
+        };
+        void overlapping(const AABB& query, int node, int ignore, std::vector<int>& result) const {
+            if(topLevel.empty() || !overlap(query, topLevel[node].bounds)) return;
+            const Node& n = topLevel[node];
+            if(n.instance >= 0) {
+                if(n.instance != ignore) result.push_back(n.instance);
+                return;
+            }
+            overlapping(query, n.left, ignore, result);
+            overlapping(query, n.right, ignore, result);
+        };
+};
+#endif
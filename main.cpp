@@ -3,6 +3,10 @@
 #include <random>
 #include <vector>
 #include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <memory>
+#include <sstream>
 #include "vec3.h"
 #include "ray.h"
 #include "math.h"
@@ -10,6 +14,16 @@
 #include "image.h"
 #include "timer.h"
 #include "aabb.h"
+#include "transfer.h"
+#include "triangle.h"
+#include "bvh.h"
+#include "scene.h"
+#include "hemicube.h"
+#include "voxelgrid.h"
+#include "display.h"
+#include "skystream.h"
+#include "reduction.h"
+#include "instance.h"
 
 #define TINYOBJLOADER_IMPLEMENTATION
 #include "tiny_obj_loader.h"
@@ -53,14 +67,26 @@ struct Sampler {
 };
 
 
-void GenSamples(Sampler* sampler, int n) {
+enum SamplerType {
+    RANDOM_SAMPLER,
+    STRATIFIED_SAMPLER
+};
+
+
+//STRATIFIED_SAMPLER jitters one sample per cell of a sqrt(n) x sqrt(n) grid, the remainder is random
+void GenSamples(Sampler* sampler, int n, SamplerType type = RANDOM_SAMPLER) {
     Sample* samples = new Sample[n];
     sampler->samples = samples;
     sampler->n = n;
 
+    const int grid = type == STRATIFIED_SAMPLER ? (int)std::sqrt((float)n) : 0;
     for(int i = 0; i < n; i++) {
         float u = rnd();
         float v = rnd();
+        if(i < grid*grid) {
+            u = (i%grid + u)/grid;
+            v = (i/grid + v)/grid;
+        }
 
         float theta = 2*std::acos(std::sqrt(1 - u));
         float phi = 2*M_PI*v;
@@ -77,6 +103,16 @@ void GenSamples(Sampler* sampler, int n) {
 }
 
 
+void FreeSamples(Sampler* sampler) {
+    for(int i = 0; i < sampler->n; i++) {
+        delete[] sampler->samples[i].sh_functions;
+    }
+    delete[] sampler->samples;
+    sampler->samples = nullptr;
+    sampler->n = 0;
+}
+
+
 void PrecomputeSH(Sampler* sampler, int bands) {
 #pragma omp parallel for
     for(int i = 0; i < sampler->n; i++) {
@@ -96,45 +132,62 @@ void PrecomputeSH(Sampler* sampler, int bands) {
 }
 
 
-Vec3 lightDir = Vec3(0, 1, 0);
-void ProjectLightFunction(Vec3* coeffs, Sampler* sampler, int bands) {
-    for(int i = 0; i < bands*bands; i++) {
-        coeffs[i] = Vec3(0, 0, 0);
+//coeffs[j] = weight * (rgb[j], rgb[n + j], rgb[2n + j])
+void StoreRGBPlanes(Vec3* coeffs, const std::vector<float>& rgb, int n, float weight) {
+    for(int j = 0; j < n; j++) {
+        coeffs[j] = Vec3(rgb[j], rgb[n + j], rgb[2*n + j]) * weight;
     }
+}
 
-#pragma omp parallel for
-    for(int i = 0; i < sampler->n; i++) {
+
+//the light is grey, so only one plane is summed
+void ProjectLightFunction(Vec3* coeffs, Sampler* sampler, int bands, const Vec3& lightDir) {
+    const int n = bands*bands;
+    std::vector<float> sum(n);
+    SHReduction reduction(n);
+    reduction.reduce(sampler->n, [&](int i, float* item) {
         Vec3 dir = sampler->samples[i].cartesian_coord;
-        Vec3 skyColor = std::max(0.5f*dot(dir, lightDir), 0.0f);
-        for(int j = 0; j < bands*bands; j++) {
-            float sh_function = sampler->samples[i].sh_functions[j];
-            coeffs[j] = coeffs[j] + skyColor * sh_function;
+        float skyColor = std::max(0.5f*dot(dir, lightDir), 0.0f);
+        if(skyColor == 0.0f) return false;
+        for(int j = 0; j < n; j++) {
+            item[j] = skyColor * sampler->samples[i].sh_functions[j];
         }
-    }
+        return true;
+    }, sum.data());
 
-    float weight = 4.0f*M_PI / sampler->n;
-    for(int i = 0; i < bands*bands; i++) {
-        coeffs[i] = coeffs[i] * weight;
+    const float weight = 4.0f*M_PI / sampler->n;
+    for(int j = 0; j < n; j++) {
+        coeffs[j] = Vec3(sum[j] * weight);
     }
 }
 
 
-struct Triangle {
-    int v0;
-    int v1;
-    int v2;
-
-    Triangle() {};
-    Triangle(int v0, int v1, int v2) : v0(v0), v1(v1), v2(v2) {};
-};
-struct Scene {
-    std::vector<Vec3> vertices;
-    std::vector<Vec3> normals;
-    std::vector<Triangle> triangles;
-    int vertices_n;
+void ProjectSky(Vec3* coeffs, Sampler* sampler, const Sky& sky, int bands) {
+    std::vector<float> dirs(3*sampler->n);
+    for(int i = 0; i < sampler->n; i++) {
+        Vec3 dir = sampler->samples[i].cartesian_coord;
+        dirs[3*i] = dir.x;
+        dirs[3*i + 1] = dir.y;
+        dirs[3*i + 2] = dir.z;
+    }
+    std::vector<float> skyColors(3*sampler->n);
+    sky.evaluate(dirs.data(), sampler->n, skyColors.data());
+
+    const int n = bands*bands;
+    std::vector<float> sum(3*n);
+    SHReduction reduction(3*n);
+    reduction.reduce(sampler->n, [&](int i, float* item) {
+        for(int j = 0; j < n; j++) {
+            float sh_function = sampler->samples[i].sh_functions[j];
+            item[j] = skyColors[3*i] * sh_function;
+            item[n + j] = skyColors[3*i + 1] * sh_function;
+            item[2*n + j] = skyColors[3*i + 2] * sh_function;
+        }
+        return true;
+    }, sum.data());
 
-    Scene() {};
-};
+    StoreRGBPlanes(coeffs, sum, n, 4.0f*M_PI / sampler->n);
+}
 
 
 void loadObj(const std::string& filename, std::vector<Vec3>& vertices, std::vector<Vec3>& normals, std::vector<Triangle>& triangles) {
@@ -180,116 +233,579 @@ void loadObj(const std::string& filename, std::vector<Vec3>& vertices, std::vect
 }
 
 
-void ProjectUnShadowed(Vec3** coeffs, Sampler* sampler, Scene* scene, int bands) {
-    for(int i = 0; i < scene->vertices_n; i++) {
-        for(int j = 0; j < bands*bands; j++) {
-            coeffs[i][j] = Vec3(0, 0, 0);
-        }
+//one directive per line:
+//    mesh <file.obj>
+//    instance <mesh index> <x> <y> <z> <yaw> <scale>
+void loadScene(const std::string& filename, InstancedScene& scene) {
+    std::ifstream file(filename);
+    if(!file) {
+        std::cerr << "failed to open " << filename << std::endl;
+        std::exit(1);
     }
 
-    for(int i = 0; i < scene->vertices_n; i++) {
-        Vec3 color = (scene->normals[i] + 1.0f)/2.0f;
-#pragma omp parallel for
-        for(int j = 0; j < sampler->n; j++) {
-            Sample& sample = sampler->samples[j];
-            float cos_term = std::max(dot(scene->normals[i], sample.cartesian_coord), 0.0f);
-            for(int k = 0; k < bands*bands; k++) {
-                float sh_function = sample.sh_functions[k];
-                coeffs[i][k] = coeffs[i][k] + sh_function * cos_term * color;
+    std::string line;
+    while(std::getline(file, line)) {
+        std::istringstream stream(line);
+        std::string directive;
+        stream >> directive;
+        if(directive == "mesh") {
+            std::string objFile;
+            stream >> objFile;
+            Scene mesh;
+            loadObj(objFile, mesh.vertices, mesh.normals, mesh.triangles);
+            mesh.vertices_n = mesh.vertices.size();
+            scene.addMesh(mesh);
+        }
+        else if(directive == "instance") {
+            int mesh;
+            Vec3 t;
+            float yaw, scale;
+            stream >> mesh >> t.x >> t.y >> t.z >> yaw >> scale;
+            if(!stream || mesh < 0 || mesh >= scene.meshes.size()) {
+                std::cerr << filename << ": bad instance: " << line << std::endl;
+                std::exit(1);
             }
+            scene.addInstance(mesh, Transform(t, yaw, scale));
         }
     }
+    std::cout << "Meshes: " << scene.meshes.size() << std::endl;
+    std::cout << "Instances: " << scene.instances.size() << std::endl;
+}
+
+
+//offset moves the ray origin off the surface along the normal, in the units of scene
+bool Visibility(Scene* scene, int vertexID, const Vec3& direction, float offset = 0.01f) {
+    Vec3 p = scene->vertices[vertexID];
+    Ray ray = Ray(p + offset*scene->normals[vertexID], direction);
+    return !scene->bvh.intersect(ray, scene->vertices, scene->triangles, vertexID);
+}
+
+
+//Sum of sh_functions(j)*color(j)*4pi/n over the samples into the planes at rgb, `planes` planes of `stride` floats.
+//sampleColor(j, color) sets color and returns false to leave sample j out.
+//samples are summed in chunks of SHReduction::CHUNK which are combined pairwise, so rounding error grows with
+//the chunk length rather than the sample count, and the result does not depend on the thread count.
+//compensating within a chunk as well costs twice as much for little gain, so it is left off.
+template <typename SampleColor>
+void SumVertexSamples(Sampler* sampler, int bands, int stride, int planes, SampleColor sampleColor, float* rgb) {
+    const int n = bands*bands;
+    SHReduction& reduction = SHReduction::local(planes*stride, false);
+    reduction.reduceSerial(sampler->n, [&](int j, float* item) {
+        Vec3 c;
+        if(!sampleColor(j, c)) return false;
+        const float* sh_functions = sampler->samples[j].sh_functions;
+        for(int p = 0; p < planes; p++) {
+            const float w = p == 0 ? c.x : (p == 1 ? c.y : c.z);
+            for(int k = 0; k < n; k++) {
+                item[p*stride + k] = sh_functions[k] * w;
+            }
+        }
+        return true;
+    }, rgb);
 
     float weight = 4.0f*M_PI / sampler->n;
-    for(int i = 0; i < scene->vertices_n; i++) {
-        for(int j = 0; j < bands*bands; j++) {
-            coeffs[i][j] = coeffs[i][j] * weight;
+    for(int k = 0; k < planes*stride; k++) {
+        rgb[k] *= weight;
+    }
+}
+
+
+//visible(j) gives the visibility of sample j from vertex i, 0 is blocked and 1 is unblocked.
+//without applyAlbedo the transfer is white, instanced transfer applies the albedo in world space.
+Vec3 VertexAlbedo(const Vec3& normal) {
+    return (normal + 1.0f)/2.0f;
+}
+template <typename VisibilityFunction>
+void ProjectShadowedVertex(TransferStore& coeffs, Sampler* sampler, Scene* scene, int bands, int i, VisibilityFunction visible, bool applyAlbedo = true) {
+    Vec3 color = applyAlbedo ? VertexAlbedo(scene->normals[i]) : Vec3(1.0f);
+    SumVertexSamples(sampler, bands, coeffs.stride, coeffs.planes, [&](int j, Vec3& c) {
+        float cos_term = dot(scene->normals[i], sampler->samples[j].cartesian_coord);
+        if(cos_term <= 0.0f) return false;
+        float v = visible(j);
+        if(v <= 0.0f) return false;
+        c = v * cos_term * color;
+        return true;
+    }, coeffs.channel(i, 0));
+}
+void ProjectShadowedVertex(TransferStore& coeffs, Sampler* sampler, Scene* scene, int bands, int i) {
+    ProjectShadowedVertex(coeffs, sampler, scene, bands, i, [&](int j) {
+        return Visibility(scene, i, sampler->samples[j].cartesian_coord);
+    });
+}
+
+
+void ProjectUnShadowed(TransferStore& coeffs, Sampler* sampler, Scene* scene, int bands) {
+#pragma omp parallel for schedule(static, 1)
+    for(int b = 0; b < coeffs.blocks_n; b++) {
+        for(int i = coeffs.blockBegin(b); i < coeffs.blockEnd(b); i++) {
+            ProjectShadowedVertex(coeffs, sampler, scene, bands, i, [](int j) {
+                return 1.0f;
+            });
         }
     }
 }
 
 
-bool RayTriangleIntersection(const Ray& ray, const Vec3& p1, const Vec3& p2, const Vec3& p3) {
-    const float eps = 1e-6;
-    const Vec3 edge1 = p2 - p1;
-    const Vec3 edge2 = p3 - p1;
-    const Vec3 h = cross(ray.direction, edge2);
-    const float a = dot(edge1, h);
-    if(a >= -eps && a <= eps) return false;
+//VOXEL_CONE traces one cone per this many samples, at most VOXEL_MAX_CONES
+const int VOXEL_SAMPLES_PER_CONE = 16;
+const int VOXEL_MAX_CONES = 64;
+enum VisibilityBackend {
+    RAY_TRACE,
+    RASTER_CUBE,
+    VOXEL_CONE
+};
+
 
-    const float f = 1.0f/a;
-    const Vec3 s = ray.origin - p1;
-    const float u = f*dot(s, h);
-    if(u < 0.0f || u > 1.0f) return false;
+//RASTER_CUBE draws a resolution^2 coverage cube per vertex and reads every sample from it.
+//VOXEL_CONE is approximate, it cone traces a resolution^3 occupancy grid and gives soft visibility.
+void ProjectShadowed(TransferStore& coeffs, Sampler* sampler, Scene* scene, int bands, VisibilityBackend backend = RAY_TRACE, int resolution = 64) {
+    if(backend == RAY_TRACE) {
+#pragma omp parallel for schedule(static, 1)
+        for(int b = 0; b < coeffs.blocks_n; b++) {
+            for(int i = coeffs.blockBegin(b); i < coeffs.blockEnd(b); i++) {
+                ProjectShadowedVertex(coeffs, sampler, scene, bands, i);
+            }
+        }
+    }
+    else if(backend == RASTER_CUBE) {
+        std::vector<int> sampleTexel(sampler->n);
+        for(int j = 0; j < sampler->n; j++) {
+            sampleTexel[j] = HemiCube::texelOf(sampler->samples[j].cartesian_coord, resolution);
+        }
 
-    const Vec3 q = cross(s, edge1);
-    const float v = f*dot(ray.direction, q);
-    if(v < 0.0f || u + v > 1.0f) return false;
+#pragma omp parallel
+        {
+            HemiCube cube(resolution, sampleTexel);
+#pragma omp for schedule(static, 1)
+            for(int b = 0; b < coeffs.blocks_n; b++) {
+                for(int i = coeffs.blockBegin(b); i < coeffs.blockEnd(b); i++) {
+                    Vec3 origin = scene->vertices[i] + 0.01f*scene->normals[i];
+                    cube.render(origin, scene->normals[i], scene->vertices, scene->triangles, scene->bvh, i);
+                    ProjectShadowedVertex(coeffs, sampler, scene, bands, i, [&](int j) {
+                        return !cube.covered(sampleTexel[j]);
+                    });
+                }
+            }
+        }
+    }
+    else {
+        VoxelGrid grid(scene->vertices, scene->triangles, resolution);
+
+        //a few wide cones per vertex instead of one ray per sample, every sample reads its nearest cone
+        const int cones_n = std::max(1, std::min(sampler->n/VOXEL_SAMPLES_PER_CONE, VOXEL_MAX_CONES));
+        std::vector<Vec3> cones(cones_n);
+        for(int c = 0; c < cones_n; c++) {
+            const float y = 1.0f - 2.0f*(c + 0.5f)/cones_n;
+            const float r = std::sqrt(1.0f - y*y);
+            const float phi = M_PI*(3.0f - std::sqrt(5.0f))*c;
+            cones[c] = Vec3(r*std::cos(phi), y, r*std::sin(phi));
+        }
+        std::vector<int> sampleCone(sampler->n);
+        for(int j = 0; j < sampler->n; j++) {
+            float best = -2.0f;
+            for(int c = 0; c < cones_n; c++) {
+                const float d = dot(cones[c], sampler->samples[j].cartesian_coord);
+                if(d > best) {
+                    best = d;
+                    sampleCone[j] = c;
+                }
+            }
+        }
+        //each cone covers the solid angle of one cone direction
+        const float halfAngle = std::acos(1.0f - 2.0f/cones_n);
+
+#pragma omp parallel for schedule(static, 1)
+        for(int b = 0; b < coeffs.blocks_n; b++) {
+            std::vector<float> coneVisibility(cones_n);
+            for(int i = coeffs.blockBegin(b); i < coeffs.blockEnd(b); i++) {
+                //only cones read by a sample above the horizon are traced, -1 marks a cone not traced yet
+                std::fill(coneVisibility.begin(), coneVisibility.end(), -1.0f);
+                for(int j = 0; j < sampler->n; j++) {
+                    const int c = sampleCone[j];
+                    if(coneVisibility[c] >= 0.0f || dot(scene->normals[i], sampler->samples[j].cartesian_coord) <= 0.0f) continue;
+                    coneVisibility[c] = grid.coneTrace(scene->vertices[i], scene->normals[i], cones[c], halfAngle);
+                }
+                ProjectShadowedVertex(coeffs, sampler, scene, bands, i, [&](int j) {
+                    return coneVisibility[sampleCone[j]];
+                });
+            }
+        }
+    }
+}
 
-    float t = f*dot(edge2, q);
-    if(t <= 0.0f) return false;
 
+//"ray", "cube" or "voxel"
+bool ParseBackend(const std::string& name, VisibilityBackend& backend) {
+    if(name == "ray") backend = RAY_TRACE;
+    else if(name == "cube") backend = RASTER_CUBE;
+    else if(name == "voxel") backend = VOXEL_CONE;
+    else return false;
     return true;
 }
 
 
-bool Visibility(Scene* scene, int vertexID, const Vec3& direction) {
-    Vec3 p = scene->vertices[vertexID];
-    for(int i = 0; i < scene->triangles.size(); i++) {
-        Triangle t = scene->triangles[i];
-        if(vertexID != t.v0 && vertexID != t.v1 && vertexID != t.v2) {
-            Vec3 v0 = scene->vertices[t.v0];
-            Vec3 v1 = scene->vertices[t.v1];
-            Vec3 v2 = scene->vertices[t.v2];
-            Ray ray = Ray(p + 0.01f*scene->normals[vertexID], direction);
-            if(RayTriangleIntersection(ray, v0, v1, v2)) {
-                return false;
+//time each resolution of an approximate backend and compare it against exact ray traced transfer
+void ReportVisibilityError(Sampler* sampler, Scene* scene, int bands, VisibilityBackend backend, const std::vector<int>& resolutions) {
+    Timer timer;
+    TransferStore exact(scene->vertices_n, bands);
+    timer.start();
+    ProjectShadowed(exact, sampler, scene, bands, RAY_TRACE);
+    timer.stop("Exact: ");
+
+    TransferStore approx(scene->vertices_n, bands);
+    for(int i = 0; i < resolutions.size(); i++) {
+        timer.start();
+        ProjectShadowed(approx, sampler, scene, bands, backend, resolutions[i]);
+        timer.stop("Resolution " + std::to_string(resolutions[i]) + ": ");
+
+        TransferError error = compareTransfer(approx, exact);
+        std::cout << "    rms: " << error.rms << " max: " << error.max << " relative: " << error.relative << std::endl;
+    }
+}
+
+
+//merge boxes whose union is no larger than the two of them, edits of neighbouring triangles collapse into a few boxes
+std::vector<AABB> MergeRegions(std::vector<AABB> regions) {
+    bool merged = true;
+    while(merged) {
+        merged = false;
+        for(int a = 0; a < regions.size(); a++) {
+            for(int b = a + 1; b < regions.size(); b++) {
+                const AABB u = mergeAABB(regions[a], regions[b]);
+                if(u.surfaceArea() > regions[a].surfaceArea() + regions[b].surfaceArea()) continue;
+                regions[a] = u;
+                regions[b] = regions.back();
+                regions.pop_back();
+                b = a;
+                merged = true;
             }
         }
     }
-    return true;
+    return regions;
 }
 
 
-void ProjectShadowed(Vec3** coeffs, Sampler* sampler, Scene* scene, int bands) {
-    for(int i = 0; i < scene->vertices_n; i++) {
-        for(int j = 0; j < bands*bands; j++) {
-            coeffs[i][j] = Vec3(0, 0, 0);
+//true when some point of b lies above the plane through p with normal n
+bool AboveHorizon(const AABB& b, const Vec3& p, const Vec3& n) {
+    for(int c = 0; c < 8; c++) {
+        if(dot(Vec3(b[c & 1].x, b[(c >> 1) & 1].y, b[(c >> 2) & 1].z) - p, n) > 0.0f) return true;
+    }
+    return false;
+}
+
+
+//Update transfer after the triangles in `modified` were moved.
+//scene->vertices must already hold the new positions, the BVH still holds the old bounds.
+//Only vertices whose shadow rays can reach the old or new bounds of the edit are recomputed, they are returned.
+std::vector<int> UpdateShadowed(TransferStore& coeffs, Sampler* sampler, Scene* scene, int bands, const std::vector<int>& modified) {
+    std::vector<AABB> regions;
+    std::vector<char> touched(scene->vertices_n, 0);
+    for(int i = 0; i < modified.size(); i++) {
+        const Triangle& t = scene->triangles[modified[i]];
+        const Vec3 v0 = scene->vertices[t.v0];
+        const Vec3 v1 = scene->vertices[t.v1];
+        const Vec3 v2 = scene->vertices[t.v2];
+
+        AABB region = scene->bvh.leafBounds(modified[i]);
+        region = mergeAABB(region, v0);
+        region = mergeAABB(region, v1);
+        region = mergeAABB(region, v2);
+        regions.push_back(region);
+
+        Vec3 n = normalize(cross(v1 - v0, v2 - v0));
+        scene->normals[t.v0] = scene->normals[t.v1] = scene->normals[t.v2] = n;
+        touched[t.v0] = touched[t.v1] = touched[t.v2] = 1;
+    }
+    scene->bvh.refit(scene->vertices, scene->triangles, modified);
+
+    regions = MergeRegions(regions);
+    AABB all;
+    for(int r = 0; r < regions.size(); r++) {
+        all = mergeAABB(all, regions[r]);
+    }
+    std::vector<Vec3> invDirs(sampler->n);
+    std::vector<int> dirIsNeg(3*sampler->n);
+    for(int j = 0; j < sampler->n; j++) {
+        const Vec3& dir = sampler->samples[j].cartesian_coord;
+        invDirs[j] = 1.0f/dir;
+        for(int a = 0; a < 3; a++) {
+            dirIsNeg[3*j + a] = invDirs[j][a] < 0;
         }
     }
 
+#pragma omp parallel for schedule(dynamic, 64)
     for(int i = 0; i < scene->vertices_n; i++) {
-        Vec3 color = (scene->normals[i] + 1.0f)/2.0f;
-#pragma omp parallel for schedule(dynamic, 1)
-        for(int j = 0; j < sampler->n; j++) {
-            Sample& sample = sampler->samples[j];
-            float cos_term = std::max(dot(scene->normals[i], sample.cartesian_coord), 0.0f);
-            if(Visibility(scene, i, sample.cartesian_coord)) {
-                for(int k = 0; k < bands*bands; k++) {
-                    float sh_function = sample.sh_functions[k];
-                    coeffs[i][k] = coeffs[i][k] + sh_function * cos_term * color;
+        if(touched[i]) continue;
+        Vec3 p = scene->vertices[i] + 0.01f*scene->normals[i];
+        //regions entirely below the tangent plane can not be reached by upper hemisphere rays
+        if(!AboveHorizon(all, p, scene->normals[i])) continue;
+        std::vector<int> visible;
+        for(int r = 0; r < regions.size(); r++) {
+            if(AboveHorizon(regions[r], p, scene->normals[i])) visible.push_back(r);
+        }
+
+        for(int j = 0; j < sampler->n && !touched[i]; j++) {
+            const Vec3& dir = sampler->samples[j].cartesian_coord;
+            if(dot(scene->normals[i], dir) <= 0.0f) continue;
+            Ray ray = Ray(p, dir);
+            if(!all.intersect(ray, invDirs[j], &dirIsNeg[3*j])) continue;
+            for(int r = 0; r < visible.size(); r++) {
+                if(regions[visible[r]].intersect(ray, invDirs[j], &dirIsNeg[3*j])) {
+                    touched[i] = 1;
+                    break;
                 }
             }
         }
     }
 
-    float weight = 4.0f*M_PI / sampler->n;
+    std::vector<int> updated;
     for(int i = 0; i < scene->vertices_n; i++) {
-        for(int j = 0; j < bands*bands; j++) {
-            coeffs[i][j] = coeffs[i][j] * weight;
+        if(touched[i]) updated.push_back(i);
+    }
+
+#pragma omp parallel for schedule(dynamic, 1)
+    for(int i = 0; i < updated.size(); i++) {
+        ProjectShadowedVertex(coeffs, sampler, scene, bands, updated[i]);
+    }
+    return updated;
+}
+
+
+
+//Transfer of an InstancedScene, all of it is white and kept in one plane stores.
+//self holds one transfer block in mesh space per mesh and scale, selfOf gives the block of each instance.
+//neighbour holds, per instance, the world space transfer its neighbours take away,
+//it is null for instances without neighbours.
+struct InstancedTransfer {
+    std::vector<std::unique_ptr<TransferStore>> self;
+    std::vector<int> selfOf;
+    std::vector<std::unique_ptr<TransferStore>> neighbour;
+};
+
+
+//precompute cost follows the unique meshes and scales plus the interacting instance pairs, not the instance count.
+//Shadow rays leave the surface 0.01 world units along the normal like Visibility on the flattened scene,
+//so self transfer is kept per scale. Only the neighbours found by InstancedScene::build cast shadows,
+//occluders further away than its interaction distance are dropped.
+void ProjectInstanced(InstancedTransfer& transfer, Sampler* sampler, InstancedScene* scene, int bands) {
+    transfer.self.clear();
+    transfer.selfOf.assign(scene->instances.size(), -1);
+    transfer.neighbour.clear();
+    std::vector<int> selfMesh;
+    std::vector<float> selfScale;
+    for(int k = 0; k < scene->instances.size(); k++) {
+        const Instance& instance = scene->instances[k];
+        for(int s = 0; s < selfMesh.size(); s++) {
+            if(selfMesh[s] == instance.mesh && selfScale[s] == instance.transform.scale) transfer.selfOf[k] = s;
+        }
+        if(transfer.selfOf[k] >= 0) continue;
+        transfer.selfOf[k] = selfMesh.size();
+        selfMesh.push_back(instance.mesh);
+        selfScale.push_back(instance.transform.scale);
+    }
+
+    for(int s = 0; s < selfMesh.size(); s++) {
+        Scene* mesh = &scene->meshes[selfMesh[s]];
+        const float offset = 0.01f/selfScale[s];
+        TransferStore* coeffs = new TransferStore(mesh->vertices_n, bands, 1);
+        transfer.self.push_back(std::unique_ptr<TransferStore>(coeffs));
+
+#pragma omp parallel for schedule(static, 1)
+        for(int b = 0; b < coeffs->blocks_n; b++) {
+            for(int i = coeffs->blockBegin(b); i < coeffs->blockEnd(b); i++) {
+                ProjectShadowedVertex(*coeffs, sampler, mesh, bands, i, [&](int j) {
+                    return Visibility(mesh, i, sampler->samples[j].cartesian_coord, offset);
+                }, false);
+            }
+        }
+    }
+
+    for(int k = 0; k < scene->instances.size(); k++) {
+        transfer.neighbour.push_back(nullptr);
+        if(scene->neighbours[k].empty()) continue;
+
+        const Instance& instance = scene->instances[k];
+        Scene* mesh = &scene->meshes[instance.mesh];
+        TransferStore* coeffs = new TransferStore(mesh->vertices_n, bands, 1);
+        transfer.neighbour[k].reset(coeffs);
+
+        //light which the mesh itself lets through but a neighbour blocks
+#pragma omp parallel for schedule(static, 1)
+        for(int b = 0; b < coeffs->blocks_n; b++) {
+            for(int i = coeffs->blockBegin(b); i < coeffs->blockEnd(b); i++) {
+                const Vec3 normal = instance.transform.vector(mesh->normals[i]);
+                const Vec3 localOrigin = mesh->vertices[i] + (0.01f/instance.transform.scale)*mesh->normals[i];
+                const Vec3 origin = instance.transform.point(localOrigin);
+                SumVertexSamples(sampler, bands, coeffs->stride, coeffs->planes, [&](int j, Vec3& c) {
+                    const Vec3& dir = sampler->samples[j].cartesian_coord;
+                    float cos_term = dot(normal, dir);
+                    if(cos_term <= 0.0f) return false;
+                    if(!scene->occludedByNeighbours(k, Ray(origin, dir))) return false;
+                    Ray local = Ray(localOrigin, instance.transform.inverseVector(dir));
+                    if(mesh->bvh.intersect(local, mesh->vertices, mesh->triangles, i)) return false;
+                    c = Vec3(cos_term);
+                    return true;
+                }, coeffs->channel(i, 0));
+            }
+        }
+    }
+}
+
+
+//world space vertices and triangles of every instance, in instance order
+void FlattenInstanced(InstancedScene* scene, std::vector<Vec3>& vertices, std::vector<Vec3>& normals, std::vector<Triangle>& triangles) {
+    for(int k = 0; k < scene->instances.size(); k++) {
+        const Instance& instance = scene->instances[k];
+        const Scene& mesh = scene->meshes[instance.mesh];
+        const int offset = vertices.size();
+        for(int i = 0; i < mesh.vertices_n; i++) {
+            vertices.push_back(instance.transform.point(mesh.vertices[i]));
+            normals.push_back(instance.transform.vector(mesh.normals[i]));
+        }
+        for(int i = 0; i < mesh.triangles.size(); i++) {
+            const Triangle& t = mesh.triangles[i];
+            triangles.push_back(Triangle(offset + t.v0, offset + t.v1, offset + t.v2));
+        }
+    }
+}
+
+
+//world transfer of the flattened vertices: rotated self transfer minus neighbour shadowing, times albedo
+void BakeInstanced(TransferStore& coeffs, const InstancedTransfer& transfer, InstancedScene* scene, int bands) {
+    std::vector<int> offsets(scene->instances.size());
+    int offset = 0;
+    for(int k = 0; k < scene->instances.size(); k++) {
+        offsets[k] = offset;
+        offset += scene->meshes[scene->instances[k].mesh].vertices_n;
+    }
+
+    const int n = bands*bands;
+#pragma omp parallel for schedule(dynamic, 1)
+    for(int k = 0; k < scene->instances.size(); k++) {
+        const Instance& instance = scene->instances[k];
+        const Scene& mesh = scene->meshes[instance.mesh];
+        const TransferStore& self = *transfer.self[transfer.selfOf[k]];
+        const TransferStore* neighbour = transfer.neighbour[k].get();
+        std::vector<float> rotated(n);
+
+        for(int i = 0; i < mesh.vertices_n; i++) {
+            const int v = offsets[k] + i;
+            const Vec3 albedo = VertexAlbedo(instance.transform.vector(mesh.normals[i]));
+            sph_rotate_y(self.channel(i, 0), rotated.data(), bands, instance.transform.yaw);
+            for(int c = 0; c < 3; c++) {
+                float* out = coeffs.channel(v, c);
+                const float a = c == 0 ? albedo.x : (c == 1 ? albedo.y : albedo.z);
+                for(int l = 0; l < n; l++) {
+                    float t = rotated[l];
+                    if(neighbour != nullptr) t -= neighbour->channel(i, 0)[l];
+                    out[l] = a*t;
+                }
+            }
         }
     }
 }
 
 
+struct QualityOptions {
+    int referenceSamples = 10000;
+    std::vector<int> samples = {25, 50, 100, 200, 400, 800, 1600};
+    std::vector<SamplerType> samplerTypes = {RANDOM_SAMPLER, STRATIFIED_SAMPLER};
+    std::vector<int> bands = {2, 3, 4, 5, 6};
+    float threshold = 0.05f;
+    std::string csv = "quality.csv";
+};
+
+
+//Sweep sample counts, sampler types and bands against a high sample stratified reference.
+//Every configuration is judged by its total error against the full reference, which splits into sampling error
+//(against the reference truncated to its own bands) and truncation error (what dropping the higher bands costs).
+//options.csv gets one row per configuration with the sampler written as random or stratified:
+//total rms, max and relative error, then the sampling and truncation parts.
+//Recommends the fastest configuration under options.threshold relative total error.
+void AnalyzeQuality(Scene* scene, const QualityOptions& options) {
+    Timer timer;
+    const int referenceBands = *std::max_element(options.bands.begin(), options.bands.end());
+    Sampler reference;
+    GenSamples(&reference, options.referenceSamples, STRATIFIED_SAMPLER);
+    PrecomputeSH(&reference, referenceBands);
+    TransferStore exact(scene->vertices_n, referenceBands);
+    timer.start();
+    ProjectShadowed(exact, &reference, scene, referenceBands);
+    timer.stop("Reference: ");
+    FreeSamples(&reference);
+
+    std::ofstream file(options.csv);
+    file << "# samples, sampler, bands, time_ms, memory_bytes, rms, max, relative, sampling_rms, sampling_relative, truncation_rms, truncation_relative" << std::endl;
+
+    bool found = false;
+    int bestSamples = 0;
+    SamplerType bestType = RANDOM_SAMPLER;
+    int bestBands = 0;
+    double bestTime = 0;
+    float bestError = 0;
+    for(int b = 0; b < options.bands.size(); b++) {
+        const int bands_n = options.bands[b];
+
+        //the reference cut down to bands_n
+        TransferStore truncated(scene->vertices_n, bands_n);
+        for(int i = 0; i < scene->vertices_n; i++) {
+            for(int k = 0; k < bands_n*bands_n; k++) {
+                truncated.set(i, k, exact.get(i, k));
+            }
+        }
+        const TransferError truncation = compareTransfer(truncated, exact);
+
+        for(int s = 0; s < options.samples.size(); s++) {
+            for(int t = 0; t < options.samplerTypes.size(); t++) {
+                const int n = options.samples[s];
+                const SamplerType type = options.samplerTypes[t];
+
+                Sampler sampler_;
+                timer.start();
+                GenSamples(&sampler_, n, type);
+                PrecomputeSH(&sampler_, bands_n);
+                TransferStore coeffs(scene->vertices_n, bands_n);
+                ProjectShadowed(coeffs, &sampler_, scene, bands_n);
+                const double time = timer.elapsed();
+                const size_t memory = coeffs.bytes + (size_t)n*(sizeof(Sample) + bands_n*bands_n*sizeof(float));
+                FreeSamples(&sampler_);
+
+                const TransferError error = compareTransfer(coeffs, exact);
+                const TransferError sampling = compareTransfer(coeffs, exact, bands_n);
+                file << n << ", " << (type == STRATIFIED_SAMPLER ? "stratified" : "random") << ", " << bands_n << ", " << time << ", " << memory << ", "
+                    << error.rms << ", " << error.max << ", " << error.relative << ", "
+                    << sampling.rms << ", " << sampling.relative << ", "
+                    << truncation.rms << ", " << truncation.relative << std::endl;
+
+                if(error.relative <= options.threshold && (!found || time < bestTime)) {
+                    found = true;
+                    bestSamples = n;
+                    bestType = type;
+                    bestBands = bands_n;
+                    bestTime = time;
+                    bestError = error.relative;
+                }
+            }
+        }
+    }
+    file.close();
+
+    if(found) {
+        std::cout << "bands = " << bestBands << ", samples = " << bestSamples << ", sampler = " << (bestType == STRATIFIED_SAMPLER ? "stratified" : "random")
+            << " (" << bestTime << "ms, relative error " << bestError << ")" << std::endl;
+    }
+    else {
+        std::cout << "no configuration reaches relative error " << options.threshold << std::endl;
+    }
+}
+
 int samples = 100;
 int bands = 5;
 Sampler sampler;
 std::vector<Vec3> vertices;
 std::vector<Vec3> normals;
 std::vector<Triangle> triangles;
-Vec3* skyCoeffs;
-Vec3** objCoeffs;
+TransferStore* objCoeffs;
 
 float cx = 0.0f;
 float cy = 0.0f;
@@ -298,8 +814,14 @@ float cz = 0.0f;
 
 int frame = 0;
 float angle = 0.0f;
+DisplayMesh* displayMesh;
+ShadingPipeline* shadingPipeline;
 void render() {
-    ProjectLightFunction(skyCoeffs, &sampler, bands);
+    bool changed;
+    const float* colors = shadingPipeline->acquire(changed);
+    if(changed) {
+        displayMesh->updateColors(colors);
+    }
 
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
@@ -308,41 +830,35 @@ void render() {
 
     glRotatef(angle, 0.0f, 1.0f, 0.0f);
 
-    glBegin(GL_TRIANGLES);
-    for(int i = 0; i < triangles.size(); i++) {
-        Triangle& t = triangles[i];
-        Vec3 v0 = vertices[t.v0];
-        Vec3 v1 = vertices[t.v1];
-        Vec3 v2 = vertices[t.v2];
-
-        Vec3 c0, c1, c2;
-        for(int k = 0; k < bands*bands; k++) {
-            c0 = c0 + skyCoeffs[k]*objCoeffs[t.v0][k];
-            c1 = c1 + skyCoeffs[k]*objCoeffs[t.v1][k];
-            c2 = c2 + skyCoeffs[k]*objCoeffs[t.v2][k];
-        }
-
-        v0 = v0 * 5;
-        v1 = v1 * 5;
-        v2 = v2 * 5;
-
-        glColor3f(c0.x, c0.y, c0.z);
-        glVertex3f(v0.x, v0.y, v0.z);
-        glColor3f(c1.x, c1.y, c1.z);
-        glVertex3f(v1.x, v1.y, v1.z);
-        glColor3f(c2.x, c2.y, c2.z);
-        glVertex3f(v2.x, v2.y, v2.z);
-    }
-    glEnd();
+    displayMesh->draw();
 
     angle += 0.1f;
     frame++;
-    lightDir = normalize(Vec3(std::sin(0.2f * angle), 0, std::cos(0.2f * angle)));
 
     glutSwapBuffers();
 }
 
 
+//sequence frames per second when lighting from a sky sequence
+float skyPlaybackRate = 2.0f;
+SkyStream* skyStream = nullptr;
+std::chrono::steady_clock::time_point playbackStart;
+
+
+//runs on the shading worker, one frame ahead of render()
+void lightFrame(int f, Vec3* coeffs) {
+    if(skyStream != nullptr) {
+        //playback starts once the stream is ready, so there is always sky lighting to hold
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - playbackStart).count();
+        skyStream->sample(seconds*skyPlaybackRate, coeffs);
+        return;
+    }
+    float a = 0.1f*f;
+    Vec3 lightDir = normalize(Vec3(std::sin(0.2f * a), 0, std::cos(0.2f * a)));
+    ProjectLightFunction(coeffs, &sampler, bands, lightDir);
+}
+
+
 void normalKeys(unsigned char key, int x, int y) {
     switch(key) {
         case 'a':
@@ -363,18 +879,71 @@ void normalKeys(unsigned char key, int x, int y) {
         case 'e':
             cz += 0.01f;
             break;
+        case 'r':
+            if(skyStream != nullptr) skyStream->report(skyPlaybackRate);
+            break;
     }
 }
 void specialKeys(int key, int x, int y) {
 }
 
 
+bool isSceneFile(const std::string& arg) {
+    return arg.size() > 6 && arg.compare(arg.size() - 6, 6, ".scene") == 0;
+}
+
+
+//bunny.obj, or the flattened instances of sceneFile
+void loadFlatScene(const std::string& sceneFile, Scene& scene) {
+    if(!sceneFile.empty()) {
+        InstancedScene instanced;
+        loadScene(sceneFile, instanced);
+        FlattenInstanced(&instanced, scene.vertices, scene.normals, scene.triangles);
+    }
+    else {
+        loadObj("bunny.obj", scene.vertices, scene.normals, scene.triangles);
+    }
+    scene.vertices_n = scene.vertices.size();
+    scene.bvh.build(scene.vertices, scene.triangles);
+}
+
+
 int main(int argc, char** argv) {
+    //-analyze runs the quality sweep, -report <cube|voxel> the visibility error report of a backend.
+    //both run on bunny.obj or a .scene argument and exit, no window is opened
+    std::string sceneFile;
+    for(int i = 1; i < argc; i++) {
+        if(isSceneFile(argv[i])) sceneFile = argv[i];
+    }
+    for(int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if(arg == "-analyze") {
+            Scene scene;
+            loadFlatScene(sceneFile, scene);
+            AnalyzeQuality(&scene, QualityOptions());
+            return 0;
+        }
+        else if(arg == "-report") {
+            VisibilityBackend backend;
+            if(i + 1 >= argc || !ParseBackend(argv[i + 1], backend) || backend == RAY_TRACE) {
+                std::cerr << "usage: -report <cube|voxel>" << std::endl;
+                std::exit(1);
+            }
+            Scene scene;
+            loadFlatScene(sceneFile, scene);
+            GenSamples(&sampler, samples);
+            PrecomputeSH(&sampler, bands);
+            ReportVisibilityError(&sampler, &scene, bands, backend, {16, 32, 64, 128});
+            return 0;
+        }
+    }
+
+    glutInit(&argc, argv);
+
     Timer timer;
     GenSamples(&sampler, samples);
     PrecomputeSH(&sampler, bands);
 
-    skyCoeffs = new Vec3[bands*bands];
     /*
      Sky* sky = TestSky();
     Timer timer;
@@ -401,28 +970,73 @@ int main(int argc, char** argv) {
     */
 
 
-    loadObj("bunny.obj", vertices, normals, triangles);
-    Scene scene;
-    scene.vertices = vertices;
-    scene.normals = normals;
-    scene.triangles = triangles;
-    scene.vertices_n = vertices.size();
+    //a .scene argument places instanced meshes, -backend <ray|cube|voxel> [resolution] picks the visibility
+    //of a single mesh, -interaction <diagonals> how far apart instances still shadow each other (negative for all pairs),
+    //the other arguments are an HDR sky sequence
+    VisibilityBackend backend = RAY_TRACE;
+    int resolution = 64;
+    float interaction = 1.0f;
+    std::vector<std::string> skyFiles;
+    for(int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if(arg == "-backend") {
+            if(i + 1 >= argc || !ParseBackend(argv[i + 1], backend)) {
+                std::cerr << "usage: -backend <ray|cube|voxel> [resolution]" << std::endl;
+                std::exit(1);
+            }
+            i++;
+            if(i + 1 < argc && std::atoi(argv[i + 1]) > 0) resolution = std::atoi(argv[++i]);
+        }
+        else if(arg == "-interaction") {
+            if(i + 1 >= argc) {
+                std::cerr << "usage: -interaction <diagonals>" << std::endl;
+                std::exit(1);
+            }
+            interaction = std::atof(argv[++i]);
+        }
+        else if(!isSceneFile(arg)) skyFiles.push_back(arg);
+    }
+
+
+    if(sceneFile.empty()) {
+        loadObj("bunny.obj", vertices, normals, triangles);
+        Scene scene;
+        scene.vertices = vertices;
+        scene.normals = normals;
+        scene.triangles = triangles;
+        scene.vertices_n = vertices.size();
+        timer.start();
+        scene.bvh.build(scene.vertices, scene.triangles);
+        timer.stop("BVH: ");
 
 
-    objCoeffs = new Vec3*[scene.vertices_n];
-    for(int i = 0; i < scene.vertices_n; i++) {
-        objCoeffs[i] = new Vec3[bands*bands];
+        objCoeffs = new TransferStore(scene.vertices_n, bands);
+        timer.start();
+        ProjectShadowed(*objCoeffs, &sampler, &scene, bands, backend, resolution);
+        timer.stop("ProjectTransferFunction: ");
+    }
+    else {
+        InstancedScene scene;
+        loadScene(sceneFile, scene);
+        timer.start();
+        scene.build(interaction);
+        timer.stop("BVH: ");
+
+        InstancedTransfer transfer;
+        timer.start();
+        ProjectInstanced(transfer, &sampler, &scene, bands);
+        timer.stop("ProjectTransferFunction: ");
+
+        FlattenInstanced(&scene, vertices, normals, triangles);
+        objCoeffs = new TransferStore(vertices.size(), bands);
+        BakeInstanced(*objCoeffs, transfer, &scene, bands);
     }
-    timer.start();
-    ProjectShadowed(objCoeffs, &sampler, &scene, bands);
-    timer.stop("ProjectTransferFunction: ");
 
 
     GenSamples(&sampler, samples);
     PrecomputeSH(&sampler, bands);
 
 
-    glutInit(&argc, argv);
     glutInitDisplayMode(GLUT_DEPTH | GLUT_DOUBLE | GLUT_RGBA);
     glutInitWindowSize(512, 512);
     glutCreateWindow("Prt_Test");
@@ -431,14 +1045,26 @@ int main(int argc, char** argv) {
     glutKeyboardFunc(normalKeys);
     glutSpecialFunc(specialKeys);
     glEnable(GL_DEPTH_TEST);
+
+    displayMesh = new DisplayMesh(vertices, triangles, 5.0f);
+    if(!skyFiles.empty()) {
+        skyStream = new SkyStream(skyFiles, bands, [](const Sky& sky, Vec3* coeffs) {
+            ProjectSky(coeffs, &sampler, sky, bands);
+        });
+        if(!skyStream->waitReady()) {
+            std::cerr << "no sky file could be loaded" << std::endl;
+            std::exit(1);
+        }
+        playbackStart = std::chrono::steady_clock::now();
+    }
+    shadingPipeline = new ShadingPipeline(*objCoeffs, lightFrame);
     glutMainLoop();
 
 
     //delete sky;
-    delete[] skyCoeffs;
-    for(int i = 0; i < scene.vertices_n; i++) {
-        delete[] objCoeffs[i];
-    }
-    delete[] objCoeffs;
+    delete skyStream;
+    delete shadingPipeline;
+    delete displayMesh;
+    delete objCoeffs;
     return 0;
 }
@@ -44,4 +44,21 @@ inline float sph(float theta, float phi, long l, long m) {
         return sph_k(l, 0)*legendre(std::cos(theta), l, 0);
     }
 }
+
+
+//coefficients of f(phi - angle) from those of f(phi), a rotation about the y axis.
+//the (m, -m) pairs of every band rotate like (cos(m*phi), sin(m*phi))
+inline void sph_rotate_y(const float* in, float* out, long bands, float angle) {
+    for(long l = 0; l < bands; l++) {
+        out[l*(l + 1)] = in[l*(l + 1)];
+        for(long m = 1; m <= l; m++) {
+            const float c = std::cos(m*angle);
+            const float s = std::sin(m*angle);
+            const float a = in[l*(l + 1) + m];
+            const float b = in[l*(l + 1) - m];
+            out[l*(l + 1) + m] = a*c - b*s;
+            out[l*(l + 1) - m] = a*s + b*c;
+        }
+    }
+}
 #endif
@@ -0,0 +1,113 @@
+#ifndef REDUCTION_H
+#define REDUCTION_H
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+
+//Sum of n vectors of `width` floats, bit reproducible for any thread count.
+//Items are split into fixed chunks of CHUNK items, every chunk is summed in item order
+//(optionally compensated), then chunk sums are combined pairwise in a fixed tree.
+//contribution(i, item) writes item i into item[0, width) and returns false when it is zero.
+//item starts zeroed for every reduction, entries a contribution never writes stay zero.
+class SHReduction {
+    public:
+        static constexpr int CHUNK = 256;
+
+        int width;
+        bool compensated;
+
+        SHReduction(int _width, bool _compensated = true) : width(_width), compensated(_compensated) {};
+
+
+        template <typename Contribution>
+        void reduce(int n, Contribution contribution, float* out) {
+            const int chunks = (n + CHUNK - 1)/CHUNK;
+            partial.resize(std::max(chunks, 1)*width);
+#pragma omp parallel
+            {
+                std::vector<float> item(width, 0.0f);
+                std::vector<float> error(width);
+#pragma omp for schedule(static)
+                for(int c = 0; c < chunks; c++) {
+                    sumChunk(c, n, contribution, item.data(), error.data());
+                }
+            }
+            combine(chunks, out);
+        };
+
+        //same result as reduce, on the calling thread only
+        template <typename Contribution>
+        void reduceSerial(int n, Contribution contribution, float* out) {
+            const int chunks = (n + CHUNK - 1)/CHUNK;
+            partial.resize(std::max(chunks, 1)*width);
+            item.assign(width, 0.0f);
+            error.resize(width);
+            for(int c = 0; c < chunks; c++) {
+                sumChunk(c, n, contribution, item.data(), error.data());
+            }
+            combine(chunks, out);
+        };
+
+
+        //reduction owned by the calling thread, for use inside parallel loops
+        static SHReduction& local(int width, bool compensated = true) {
+            thread_local SHReduction reduction(width, compensated);
+            reduction.width = width;
+            reduction.compensated = compensated;
+            return reduction;
+        };
+
+    private:
+        std::vector<float> partial;
+        std::vector<float> item;
+        std::vector<float> error;
+
+        template <typename Contribution>
+        void sumChunk(int c, int n, Contribution& contribution, float* x, float* err) {
+            float* sum = &partial[c*width];
+            std::fill(sum, sum + width, 0.0f);
+            std::fill(err, err + width, 0.0f);
+
+            const int last = std::min((c + 1)*CHUNK, n);
+            for(int i = c*CHUNK; i < last; i++) {
+                if(!contribution(i, x)) continue;
+                if(compensated) {
+                    //Neumaier summation
+                    for(int k = 0; k < width; k++) {
+                        const float t = sum[k] + x[k];
+                        if(std::abs(sum[k]) >= std::abs(x[k])) err[k] += (sum[k] - t) + x[k];
+                        else err[k] += (x[k] - t) + sum[k];
+                        sum[k] = t;
+                    }
+                }
+                else {
+                    for(int k = 0; k < width; k++) {
+                        sum[k] += x[k];
+                    }
+                }
+            }
+
+            if(compensated) {
+                for(int k = 0; k < width; k++) {
+                    sum[k] += err[k];
+                }
+            }
+        };
+
+        void combine(int chunks, float* out) {
+            for(int step = 1; step < chunks; step *= 2) {
+                for(int c = 0; c + step < chunks; c += 2*step) {
+                    float* a = &partial[c*width];
+                    const float* b = &partial[(c + step)*width];
+                    for(int k = 0; k < width; k++) {
+                        a[k] += b[k];
+                    }
+                }
+            }
+            for(int k = 0; k < width; k++) {
+                out[k] = chunks > 0 ? partial[k] : 0.0f;
+            }
+        };
+};
+#endif
@@ -0,0 +1,16 @@
+#ifndef SCENE_H
+#define SCENE_H
+#include <vector>
+#include "vec3.h"
+#include "triangle.h"
+#include "bvh.h"
+struct Scene {
+    std::vector<Vec3> vertices;
+    std::vector<Vec3> normals;
+    std::vector<Triangle> triangles;
+    int vertices_n;
+    BVH bvh;
+
+    Scene() {};
+};
+#endif
@@ -1,6 +1,13 @@
 #ifndef SKY_H
 #define SKY_H
 #include <string>
+#include <vector>
+#include <cstdlib>
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <atomic>
+#include <mutex>
 
 #ifndef STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_IMPLEMENTATION
@@ -20,7 +27,12 @@ float clamp(float x, float xmin, float xmax) {
 class Sky {
     public:
         Sky() {};
+        virtual ~Sky() {};
+
         virtual Vec3 getSky(const Vec3& dir) const = 0;
+
+        //evaluate n directions at once. dirs and rgb_out are packed xyz and rgb.
+        virtual void evaluate(const float* dirs, size_t n, float* rgb_out) const = 0;
 };
 
 
@@ -32,6 +44,14 @@ class TestSky : public Sky {
             float v = std::max(dot(dir, Vec3(0, 1, 0)), 0.0f);
             return Vec3(v, v, v);
         };
+        void evaluate(const float* dirs, size_t n, float* rgb_out) const {
+            for(size_t i = 0; i < n; i++) {
+                float v = std::max(dirs[3*i + 1], 0.0f);
+                rgb_out[3*i] = v;
+                rgb_out[3*i + 1] = v;
+                rgb_out[3*i + 2] = v;
+            }
+        };
 };
 
 
@@ -44,6 +64,13 @@ class UniformSky : public Sky {
         Vec3 getSky(const Vec3& dir) const {
             return color;
         };
+        void evaluate(const float* dirs, size_t n, float* rgb_out) const {
+            for(size_t i = 0; i < n; i++) {
+                rgb_out[3*i] = color.x;
+                rgb_out[3*i + 1] = color.y;
+                rgb_out[3*i + 2] = color.z;
+            }
+        };
 };
 
 
@@ -55,10 +82,24 @@ class SimpleSky : public Sky {
             float t = (dir.y + 1.0f)*0.5f;
             return (1.0f - t)*Vec3(1.0f) + t*Vec3(0.5f, 0.7f, 1.0f);
         };
+        void evaluate(const float* dirs, size_t n, float* rgb_out) const {
+            for(size_t i = 0; i < n; i++) {
+                float t = (dirs[3*i + 1] + 1.0f)*0.5f;
+                rgb_out[3*i] = 1.0f - 0.5f*t;
+                rgb_out[3*i + 1] = 1.0f - 0.3f*t;
+                rgb_out[3*i + 2] = 1.0f;
+            }
+        };
 };
 
 
-class IBL : public Sky {
+//Equirectangular HDR environment.
+//getSky samples the original image. evaluate wraps the offsets once per batch and samples the image too,
+//until the sky has been evaluated in as many directions as the octahedral map has texels. From then on
+//evaluate reads an octahedral resampling with the offsets already applied, built once on first need.
+//A sky evaluated once per frame, like a streamed one, never pays for the map.
+//Call setOffset instead of writing offsetX/offsetY so the octahedral map is rebuilt.
+class IBL final : public Sky {
     public:
         int width;
         int height;
@@ -66,30 +107,197 @@ class IBL : public Sky {
         float offsetX;
         float offsetY;
 
-        IBL(const std::string& filename, float _offsetX, float _offsetY) : offsetX(_offsetX), offsetY(_offsetY) {
+        int octRes;
+
+        //with exitOnFailure false a failed load leaves an empty sky, check loaded()
+        IBL(const std::string& filename, float _offsetX, float _offsetY, bool exitOnFailure = true) : offsetX(_offsetX), offsetY(_offsetY) {
             int n;
-            HDRI = stbi_loadf(filename.c_str(), &width, &height, &n, 0);
+            HDRI = stbi_loadf(filename.c_str(), &width, &height, &n, 3);
+            if(HDRI == nullptr) {
+                std::cerr << "failed to load " << filename << std::endl;
+                if(exitOnFailure) std::exit(1);
+                width = height = 0;
+            }
+            octRes = std::max(16, (int)std::sqrt((float)width*height));
         };
         ~IBL() {
             stbi_image_free(HDRI);
         };
 
+
+        void setOffset(float _offsetX, float _offsetY) {
+            offsetX = _offsetX;
+            offsetY = _offsetY;
+            if(octReady) buildOctMap();
+        };
+
+
+        bool loaded() const {
+            return HDRI != nullptr;
+        };
+
+
         Vec3 getSky(const Vec3& dir) const {
-            float phi = std::atan2(dir.z, dir.x);
+            return direct(dir.x, dir.y, dir.z, wrap(offsetX, 2*M_PI), wrap(offsetY, M_PI));
+        };
+
+        void evaluate(const float* dirs, size_t n, float* rgb_out) const {
+            if(!octReady && (evaluated += n) >= (size_t)octRes*octRes) {
+                std::lock_guard<std::mutex> lock(octMutex);
+                if(!octReady) buildOctMap();
+            }
+
+            if(octReady) {
+                for(size_t i = 0; i < n; i++) {
+                    float u, v;
+                    octEncode(dirs[3*i], dirs[3*i + 1], dirs[3*i + 2], u, v);
+                    octLookup(u, v, rgb_out + 3*i);
+                }
+                return;
+            }
+
+            const float ox = wrap(offsetX, 2*M_PI);
+            const float oy = wrap(offsetY, M_PI);
+            for(size_t i = 0; i < n; i++) {
+                Vec3 c = direct(dirs[3*i], dirs[3*i + 1], dirs[3*i + 2], ox, oy);
+                rgb_out[3*i] = c.x;
+                rgb_out[3*i + 1] = c.y;
+                rgb_out[3*i + 2] = c.z;
+            }
+        };
+
+
+        //resample into the octahedral map now instead of on first need
+        void buildOctMap() const {
+            octMap.resize(3*octRes*octRes);
+            const float ox = wrap(offsetX, 2*M_PI);
+            const float oy = wrap(offsetY, M_PI);
+#pragma omp parallel for
+            for(int j = 0; j < octRes; j++) {
+                for(int i = 0; i < octRes; i++) {
+                    float u = (i + 0.5f)/octRes*2.0f - 1.0f;
+                    float v = (j + 0.5f)/octRes*2.0f - 1.0f;
+                    Vec3 d = octDecode(u, v);
+                    Vec3 c = direct(d.x, d.y, d.z, ox, oy);
+                    int adr = 3*(i + octRes*j);
+                    octMap[adr] = c.x;
+                    octMap[adr+1] = c.y;
+                    octMap[adr+2] = c.z;
+                }
+            }
+            octReady = true;
+        };
+
+    private:
+        mutable std::vector<float> octMap;
+        mutable std::atomic<bool> octReady{false};
+        mutable std::atomic<size_t> evaluated{0};
+        mutable std::mutex octMutex;
+
+        //x in [0, period)
+        static float wrap(float x, float period) {
+            x = std::fmod(x, period);
+            return x < 0 ? x + period : x;
+        };
+
+        //ox and oy already wrapped, phi + ox and theta + oy stay below two periods
+        Vec3 direct(float x, float y, float z, float ox, float oy) const {
+            float phi = std::atan2(z, x);
             if(phi < 0) phi += 2*M_PI;
-            phi += offsetX;
-            if(phi > 2*M_PI) phi -= 2*M_PI;
-            float theta = std::acos(clamp(dir.y, -1.0f, 1.0f));
-            theta += offsetY;
-            if(theta > M_PI) theta -= M_PI;
-
-            float u = phi/(2.0*M_PI);
-            float v = theta/M_PI;
-
-            int w = (int)(u * width);
-            int h = (int)(v * height);
-            int adr = 3*w + 3*width*h;
+            phi += ox;
+            if(phi >= 2*M_PI) phi -= 2*M_PI;
+            float theta = std::acos(clamp(y, -1.0f, 1.0f)) + oy;
+            if(theta >= M_PI) theta -= M_PI;
+
+            return equirect(phi/(2.0*M_PI), theta/M_PI);
+        };
+
+        //bilinear fetch, wraps horizontally and clamps at the poles
+        Vec3 equirect(float u, float v) const {
+            float fx = u*width - 0.5f;
+            float fy = clamp(v*height - 0.5f, 0.0f, height - 1.0f);
+            int x0 = (int)std::floor(fx);
+            int y0 = (int)fy;
+            float tx = fx - x0;
+            float ty = fy - y0;
+            int x1 = x0 + 1;
+            int y1 = std::min(y0 + 1, height - 1);
+            x0 = (x0 % width + width) % width;
+            x1 = (x1 % width + width) % width;
+
+            Vec3 c00 = texel(x0, y0);
+            Vec3 c10 = texel(x1, y0);
+            Vec3 c01 = texel(x0, y1);
+            Vec3 c11 = texel(x1, y1);
+            return (1 - ty)*((1 - tx)*c00 + tx*c10) + ty*((1 - tx)*c01 + tx*c11);
+        };
+        Vec3 texel(int x, int y) const {
+            int adr = 3*x + 3*width*y;
             return Vec3(HDRI[adr], HDRI[adr+1], HDRI[adr+2]);
         };
+
+
+        static void octEncode(float x, float y, float z, float& u, float& v) {
+            float s = 1.0f/(std::abs(x) + std::abs(y) + std::abs(z));
+            x *= s;
+            y *= s;
+            z *= s;
+            if(y >= 0) {
+                u = x;
+                v = z;
+            }
+            else {
+                u = (1.0f - std::abs(z))*(x >= 0 ? 1.0f : -1.0f);
+                v = (1.0f - std::abs(x))*(z >= 0 ? 1.0f : -1.0f);
+            }
+        };
+        static Vec3 octDecode(float u, float v) {
+            float y = 1.0f - std::abs(u) - std::abs(v);
+            float x = u;
+            float z = v;
+            if(y < 0) {
+                x = (1.0f - std::abs(v))*(u >= 0 ? 1.0f : -1.0f);
+                z = (1.0f - std::abs(u))*(v >= 0 ? 1.0f : -1.0f);
+            }
+            return normalize(Vec3(x, y, z));
+        };
+
+
+        //crossing an edge of the octahedral map mirrors the other coordinate
+        const float* octTexel(int x, int y) const {
+            if(x < 0) {
+                x = -x - 1;
+                y = octRes - 1 - y;
+            }
+            else if(x >= octRes) {
+                x = 2*octRes - 1 - x;
+                y = octRes - 1 - y;
+            }
+            if(y < 0) {
+                y = -y - 1;
+                x = octRes - 1 - x;
+            }
+            else if(y >= octRes) {
+                y = 2*octRes - 1 - y;
+                x = octRes - 1 - x;
+            }
+            return &octMap[3*(x + octRes*y)];
+        };
+        void octLookup(float u, float v, float* rgb) const {
+            float fx = (u + 1.0f)*0.5f*octRes - 0.5f;
+            float fy = (v + 1.0f)*0.5f*octRes - 0.5f;
+            int x0 = (int)std::floor(fx);
+            int y0 = (int)std::floor(fy);
+            float tx = fx - x0;
+            float ty = fy - y0;
+
+            const float* c00 = octTexel(x0, y0);
+            const float* c10 = octTexel(x0 + 1, y0);
+            const float* c01 = octTexel(x0, y0 + 1);
+            const float* c11 = octTexel(x0 + 1, y0 + 1);
+            for(int k = 0; k < 3; k++) {
+                rgb[k] = (1 - ty)*((1 - tx)*c00[k] + tx*c10[k]) + ty*((1 - tx)*c01[k] + tx*c11[k]);
+            }
+        };
 };
 #endif
@@ -0,0 +1,182 @@
+#ifndef SKYSTREAM_H
+#define SKYSTREAM_H
+#include <vector>
+#include <string>
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <cmath>
+#include "vec3.h"
+#include "sky.h"
+
+
+//Plays a sequence of HDR environment maps as SH lighting.
+//A background thread decodes and projects frames ahead of playback into a bounded ring of coefficient sets.
+//sample() never waits for it, when a frame is late the newest projected lighting is held.
+//Files which fail to load are skipped from then on, the sequence plays the remaining ones.
+class SkyStream {
+    public:
+        typedef std::function<void(const Sky&, Vec3*)> ProjectFunction;
+
+        SkyStream(const std::vector<std::string>& _filenames, int _bands, ProjectFunction _project, int _capacity = 8, float _offsetX = 0.0f, float _offsetY = 0.0f)
+            : filenames(_filenames), bands(_bands), project(_project), capacity(_capacity), offsetX(_offsetX), offsetY(_offsetY) {
+            const int n = bands*bands;
+            ring.resize(capacity);
+            for(int i = 0; i < capacity; i++) {
+                ring[i].resize(n);
+            }
+            held.resize(n);
+            worker = std::thread(&SkyStream::run, this);
+        };
+        ~SkyStream() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+            }
+            spaceCondition.notify_one();
+            worker.join();
+        };
+
+        SkyStream(const SkyStream&) = delete;
+        SkyStream& operator=(const SkyStream&) = delete;
+
+
+        //lighting at sequence time t, measured in frames of the sequence. t must not decrease.
+        //returns false when nothing has been projected yet, coeffs is left untouched then.
+        bool sample(double t, Vec3* coeffs) {
+            const long f0 = (long)std::floor(t);
+            const float w = t - f0;
+
+            std::lock_guard<std::mutex> lock(mutex);
+            requests++;
+            //frames before f0 are not needed anymore
+            bool released = false;
+            while(head < f0 && head + 1 < tail) {
+                head++;
+                released = true;
+            }
+            if(released) spaceCondition.notify_one();
+
+            if(head <= f0 && f0 + 1 < tail) {
+                const std::vector<Vec3>& c0 = ring[f0%capacity];
+                const std::vector<Vec3>& c1 = ring[(f0 + 1)%capacity];
+                for(int k = 0; k < bands*bands; k++) {
+                    held[k] = (1.0f - w)*c0[k] + w*c1[k];
+                }
+                hasHeld = true;
+            }
+            else if(tail > head) {
+                //late, hold the newest frame we have
+                const std::vector<Vec3>& c = ring[(tail - 1)%capacity];
+                for(int k = 0; k < bands*bands; k++) {
+                    held[k] = c[k];
+                }
+                hasHeld = true;
+                late++;
+            }
+            else {
+                late++;
+            }
+
+            if(!hasHeld) return false;
+            for(int k = 0; k < bands*bands; k++) {
+                coeffs[k] = held[k];
+            }
+            return true;
+        };
+
+
+        //blocks until the first two frames are projected, the pair sample() interpolates between at t = 0.
+        //returns false when no file could be loaded.
+        bool waitReady() {
+            std::unique_lock<std::mutex> lock(mutex);
+            readyCondition.wait(lock, [&] { return tail >= 2 || skipped == filenames.size(); });
+            return tail > 0;
+        };
+
+
+        //decode and projection throughput against the playback rate, in sequence frames per second
+        void report(float playbackRate) {
+            std::lock_guard<std::mutex> lock(mutex);
+            const double total = decodeSeconds + projectSeconds;
+            const double throughput = total > 0 ? produced/total : 0.0;
+            std::cout << "SkyStream: " << produced << " frames produced, " << (tail - head) << "/" << capacity << " buffered" << std::endl;
+            std::cout << "    decode: " << (produced > 0 ? 1000.0*decodeSeconds/produced : 0.0) << "ms/frame" << std::endl;
+            std::cout << "    project: " << (produced > 0 ? 1000.0*projectSeconds/produced : 0.0) << "ms/frame" << std::endl;
+            std::cout << "    throughput: " << throughput << " frames/s, playback: " << playbackRate << " frames/s" << std::endl;
+            std::cout << "    late: " << late << "/" << requests << " samples" << std::endl;
+            std::cout << "    skipped: " << skipped << "/" << filenames.size() << " files failed to load" << std::endl;
+        };
+
+    private:
+        const std::vector<std::string> filenames;
+        const int bands;
+        ProjectFunction project;
+        const int capacity;
+        const float offsetX;
+        const float offsetY;
+
+        //frames [head, tail) are in the ring, frame i lives in slot i%capacity
+        std::vector<std::vector<Vec3>> ring;
+        long head = 0;
+        long tail = 0;
+        std::vector<Vec3> held;
+        bool hasHeld = false;
+
+        long produced = 0;
+        long requests = 0;
+        long late = 0;
+        long skipped = 0;
+        double decodeSeconds = 0;
+        double projectSeconds = 0;
+
+        std::thread worker;
+        std::mutex mutex;
+        std::condition_variable spaceCondition;
+        std::condition_variable readyCondition;
+        bool stop = false;
+
+        //the sequence loops over the files, the ones that fail to load are left out.
+        //the sky is evaluated once per frame, so no octahedral map is built
+        void run() {
+            std::vector<Vec3> coeffs(bands*bands);
+            std::vector<char> failed(filenames.size(), 0);
+            for(long f = 0; ; f++) {
+                const int file = f%filenames.size();
+                if(failed[file]) continue;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    spaceCondition.wait(lock, [&] { return stop || tail - head < capacity; });
+                    if(stop) return;
+                }
+
+                auto t0 = std::chrono::steady_clock::now();
+                IBL sky(filenames[file], offsetX, offsetY, false);
+                if(!sky.loaded()) {
+                    failed[file] = 1;
+                    std::lock_guard<std::mutex> lock(mutex);
+                    //nothing left to play
+                    if(++skipped == filenames.size()) {
+                        readyCondition.notify_all();
+                        return;
+                    }
+                    continue;
+                }
+                auto t1 = std::chrono::steady_clock::now();
+                project(sky, coeffs.data());
+                auto t2 = std::chrono::steady_clock::now();
+
+                std::lock_guard<std::mutex> lock(mutex);
+                ring[tail%capacity] = coeffs;
+                tail++;
+                produced++;
+                decodeSeconds += std::chrono::duration<double>(t1 - t0).count();
+                projectSeconds += std::chrono::duration<double>(t2 - t1).count();
+                if(tail == 2) readyCondition.notify_all();
+            }
+        };
+};
+#endif
@@ -16,6 +16,11 @@ class Timer {
         void start() {
             tstart = std::chrono::system_clock::now();
         }
+        //milliseconds since start()
+        double elapsed() const {
+            auto dur = std::chrono::system_clock::now() - tstart;
+            return std::chrono::duration<double, std::milli>(dur).count();
+        };
         void stop(const std::string& message = "") {
             tend = std::chrono::system_clock::now();
             auto dur = tend - tstart;
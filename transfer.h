@@ -0,0 +1,175 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+#include <sys/mman.h>
+#include <omp.h>
+#include "vec3.h"
+
+
+//Transfer coefficients of every vertex in one arena.
+//Each vertex holds three planes (R, G, B) of `stride` floats, stride is bands*bands padded to a cache line.
+//A store with one plane holds grey transfer, every channel reads that plane.
+//Vertices are grouped in page aligned blocks, and blocks are first touched by the thread which later computes them.
+class TransferStore {
+    public:
+        static constexpr size_t CACHE_LINE = 64;
+        static constexpr size_t PAGE = 4096;
+        static constexpr size_t HUGE_PAGE = 2*1024*1024;
+
+        int vertices_n;
+        int bands;
+        int planes;
+        int stride;
+        int blockSize;
+        int blocks_n;
+        float* data;
+        size_t bytes;
+
+        TransferStore(int _vertices_n, int _bands, int _planes = 3) : vertices_n(_vertices_n), bands(_bands), planes(_planes) {
+            const size_t lineFloats = CACHE_LINE/sizeof(float);
+            stride = (bands*bands + lineFloats - 1)/lineFloats*lineFloats;
+            const size_t vertexBytes = planes*stride*sizeof(float);
+
+            //huge pages only pay off when every thread still gets several blocks.
+            //a block is lcm(page, vertexBytes), which can span several huge pages, so count blocks, not pages
+#ifdef _OPENMP
+            const size_t threads = omp_get_max_threads();
+#else
+            const size_t threads = 1;
+#endif
+            const size_t hugeBlockSize = HUGE_PAGE/gcd(HUGE_PAGE, vertexBytes);
+            const size_t hugeBlocks = (vertices_n + hugeBlockSize - 1)/hugeBlockSize;
+            usesHugePages = hugeBlocks >= 4*threads;
+            const size_t page = usesHugePages ? HUGE_PAGE : PAGE;
+            blockSize = page/gcd(page, vertexBytes);
+            blocks_n = (vertices_n + blockSize - 1)/blockSize;
+            bytes = vertexBytes*blockSize*blocks_n;
+
+            //over allocate so data can be aligned to the page size
+            mapped = bytes + page;
+            void* p = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if(p == MAP_FAILED) {
+                std::cerr << "TransferStore: failed to allocate " << bytes << " bytes" << std::endl;
+                std::exit(1);
+            }
+            base = p;
+            data = (float*)(((uintptr_t)p + page - 1)/page*page);
+            if(usesHugePages) {
+                madvise(data, bytes, MADV_HUGEPAGE);
+            }
+
+            firstTouch();
+        };
+        ~TransferStore() {
+            munmap(base, mapped);
+        };
+
+        TransferStore(const TransferStore&) = delete;
+        TransferStore& operator=(const TransferStore&) = delete;
+
+
+        int blockBegin(int b) const {
+            return b*blockSize;
+        };
+        int blockEnd(int b) const {
+            return std::min((b + 1)*blockSize, vertices_n);
+        };
+
+
+        float* channel(int v, int c) {
+            return data + (planes*(size_t)v + std::min(c, planes - 1))*stride;
+        };
+        const float* channel(int v, int c) const {
+            return data + (planes*(size_t)v + std::min(c, planes - 1))*stride;
+        };
+
+        Vec3 get(int v, int k) const {
+            return Vec3(channel(v, 0)[k], channel(v, 1)[k], channel(v, 2)[k]);
+        };
+        void set(int v, int k, const Vec3& c) {
+            channel(v, 0)[k] = c.x;
+            channel(v, 1)[k] = c.y;
+            channel(v, 2)[k] = c.z;
+        };
+        void clear(int v) {
+            std::memset(channel(v, 0), 0, planes*stride*sizeof(float));
+        };
+
+
+        //color of vertex v lit by sky coefficients
+        Vec3 shade(int v, const Vec3* skyCoeffs) const {
+            const float* r = channel(v, 0);
+            const float* g = channel(v, 1);
+            const float* b = channel(v, 2);
+            Vec3 c;
+            for(int k = 0; k < bands*bands; k++) {
+                c.x += skyCoeffs[k].x*r[k];
+                c.y += skyCoeffs[k].y*g[k];
+                c.z += skyCoeffs[k].z*b[k];
+            }
+            return c;
+        };
+
+    private:
+        void* base;
+        size_t mapped;
+        bool usesHugePages;
+
+        static size_t gcd(size_t a, size_t b) {
+            while(b != 0) {
+                size_t t = a % b;
+                a = b;
+                b = t;
+            }
+            return a;
+        };
+
+        //same schedule as the projection loops, so each block lands on the NUMA node of its thread
+        void firstTouch() {
+#pragma omp parallel for schedule(static, 1)
+            for(int b = 0; b < blocks_n; b++) {
+                float* p = channel(blockBegin(b), 0);
+                std::memset(p, 0, planes*stride*sizeof(float)*blockSize);
+            }
+        };
+};
+
+
+struct TransferError {
+    float rms;
+    float max;
+    float relative;
+};
+
+
+//per vertex L2 distance of the coefficient vectors, rms and max over vertices, relative to the exact energy.
+//bands > 0 compares only the first bands of both, as if exact was truncated to them
+inline TransferError compareTransfer(const TransferStore& approx, const TransferStore& exact, int bands = 0) {
+    const int n = bands > 0 ? std::min(bands, exact.bands)*std::min(bands, exact.bands) : exact.bands*exact.bands;
+    double sum = 0;
+    double norm = 0;
+    float maxError = 0;
+    for(int i = 0; i < exact.vertices_n; i++) {
+        double e = 0;
+        for(int k = 0; k < n; k++) {
+            const Vec3 a = k < approx.bands*approx.bands ? approx.get(i, k) : Vec3();
+            const Vec3 d = a - exact.get(i, k);
+            e += d.length2();
+            norm += exact.get(i, k).length2();
+        }
+        sum += e;
+        maxError = std::max(maxError, (float)std::sqrt(e));
+    }
+
+    TransferError error;
+    error.rms = std::sqrt(sum/exact.vertices_n);
+    error.max = maxError;
+    error.relative = norm > 0 ? std::sqrt(sum/norm) : 0.0f;
+    return error;
+}
+#endif
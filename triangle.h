@@ -0,0 +1,37 @@
+#ifndef TRIANGLE_H
+#define TRIANGLE_H
+#include "vec3.h"
+#include "ray.h"
+struct Triangle {
+    int v0;
+    int v1;
+    int v2;
+
+    Triangle() {};
+    Triangle(int v0, int v1, int v2) : v0(v0), v1(v1), v2(v2) {};
+};
+
+
+inline bool RayTriangleIntersection(const Ray& ray, const Vec3& p1, const Vec3& p2, const Vec3& p3) {
+    const float eps = 1e-6;
+    const Vec3 edge1 = p2 - p1;
+    const Vec3 edge2 = p3 - p1;
+    const Vec3 h = cross(ray.direction, edge2);
+    const float a = dot(edge1, h);
+    if(a >= -eps && a <= eps) return false;
+
+    const float f = 1.0f/a;
+    const Vec3 s = ray.origin - p1;
+    const float u = f*dot(s, h);
+    if(u < 0.0f || u > 1.0f) return false;
+
+    const Vec3 q = cross(s, edge1);
+    const float v = f*dot(ray.direction, q);
+    if(v < 0.0f || u + v > 1.0f) return false;
+
+    float t = f*dot(edge2, q);
+    if(t <= 0.0f) return false;
+
+    return true;
+}
+#endif
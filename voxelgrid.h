@@ -0,0 +1,159 @@
+#ifndef VOXELGRID_H
+#define VOXELGRID_H
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include "vec3.h"
+#include "aabb.h"
+#include "triangle.h"
+
+
+//Occupancy grid of a triangle soup with a mip pyramid for cone tracing.
+//Level 0 is res^3 binary voxels, every further level averages 2x2x2 children.
+class VoxelGrid {
+    public:
+        int res;
+        AABB bounds;
+        float voxelSize;
+        std::vector<int> levelRes;
+        std::vector<std::vector<float>> levels;
+
+        VoxelGrid(const std::vector<Vec3>& vertices, const std::vector<Triangle>& triangles, int _res) : res(_res) {
+            AABB b;
+            for(int i = 0; i < vertices.size(); i++) {
+                b = mergeAABB(b, vertices[i]);
+            }
+            //cubic bounds with a one voxel margin
+            const Vec3 center = 0.5f*(b.pMin + b.pMax);
+            const Vec3 extent = b.pMax - b.pMin;
+            const float size = std::max(extent.x, std::max(extent.y, extent.z))*(res + 2.0f)/res;
+            bounds = AABB(center - 0.5f*size, center + 0.5f*size);
+            voxelSize = size/res;
+
+            levelRes.push_back(res);
+            levels.push_back(std::vector<float>(res*res*res, 0.0f));
+            for(int i = 0; i < triangles.size(); i++) {
+                const Triangle& t = triangles[i];
+                voxelize(vertices[t.v0], vertices[t.v1], vertices[t.v2]);
+            }
+            buildMips();
+        };
+
+
+        //fraction of light arriving at a surface point through a cone around dir, in [0, 1]
+        //halfAngle is the cone half angle in radians, normal is the surface normal at origin.
+        //A sample at level l reads voxels up to three texels of that level away, so tracing starts three voxels
+        //above the surface and the level is capped by the height above the tangent plane,
+        //otherwise the cone would pick up the voxels of its own surface.
+        //A cone whose axis dips below the horizon is bent onto the tangent plane for the same reason.
+        float coneTrace(const Vec3& origin, const Vec3& normal, const Vec3& axis, float halfAngle) const {
+            const float tanHalf = std::tan(halfAngle);
+            const float tmax = (bounds.pMax - bounds.pMin).length();
+            const float lift = 3.0f*voxelSize;
+            const float rise = std::max(dot(normal, axis), 0.0f);
+            const Vec3 dir = rise > 0.0f ? axis : normalize(axis - dot(normal, axis)*normal);
+            const Vec3 start = origin + lift*normal;
+            float opacity = 0.0f;
+            float t = voxelSize;
+            while(t < tmax && opacity < 0.99f) {
+                const Vec3 p = start + t*dir;
+                if(!inside(p)) break;
+
+                const float height = lift + t*rise;
+                const float diameter = std::min(std::max(voxelSize, 2.0f*t*tanHalf), std::max(voxelSize, height/3.0f));
+                const float lod = std::log2(diameter/voxelSize);
+                const float occupancy = sample(p, lod);
+                opacity += (1.0f - opacity)*std::min(occupancy, 1.0f);
+                t += 0.5f*diameter;
+            }
+            return 1.0f - std::min(opacity, 1.0f);
+        };
+
+    private:
+        bool inside(const Vec3& p) const {
+            return p.x >= bounds.pMin.x && p.y >= bounds.pMin.y && p.z >= bounds.pMin.z &&
+                p.x <= bounds.pMax.x && p.y <= bounds.pMax.y && p.z <= bounds.pMax.z;
+        };
+
+
+        //mark every voxel touched by points spread at most half a voxel apart over the triangle
+        void voxelize(const Vec3& v0, const Vec3& v1, const Vec3& v2) {
+            const float longest = std::max((v1 - v0).length(), std::max((v2 - v1).length(), (v0 - v2).length()));
+            const int n = std::max(1, (int)std::ceil(2.0f*longest/voxelSize));
+            std::vector<float>& grid = levels[0];
+            for(int i = 0; i <= n; i++) {
+                for(int j = 0; j <= n - i; j++) {
+                    const float u = (float)i/n;
+                    const float v = (float)j/n;
+                    const Vec3 p = v0 + u*(v1 - v0) + v*(v2 - v0);
+                    const Vec3 o = (p - bounds.pMin)/voxelSize;
+                    const int x = std::min(std::max((int)o.x, 0), res - 1);
+                    const int y = std::min(std::max((int)o.y, 0), res - 1);
+                    const int z = std::min(std::max((int)o.z, 0), res - 1);
+                    grid[x + res*(y + res*z)] = 1.0f;
+                }
+            }
+        };
+
+        void buildMips() {
+            while(levelRes.back() > 1) {
+                const int r = levelRes.back();
+                const int h = (r + 1)/2;
+                const std::vector<float>& fine = levels.back();
+                std::vector<float> coarse(h*h*h, 0.0f);
+                for(int z = 0; z < h; z++) {
+                    for(int y = 0; y < h; y++) {
+                        for(int x = 0; x < h; x++) {
+                            float sum = 0.0f;
+                            for(int k = 0; k < 8; k++) {
+                                const int fx = std::min(2*x + (k & 1), r - 1);
+                                const int fy = std::min(2*y + ((k >> 1) & 1), r - 1);
+                                const int fz = std::min(2*z + ((k >> 2) & 1), r - 1);
+                                sum += fine[fx + r*(fy + r*fz)];
+                            }
+                            coarse[x + h*(y + h*z)] = sum/8.0f;
+                        }
+                    }
+                }
+                levelRes.push_back(h);
+                levels.push_back(coarse);
+            }
+        };
+
+
+        //trilinear inside a level
+        float sampleLevel(const Vec3& p, int level) const {
+            const int r = levelRes[level];
+            const std::vector<float>& grid = levels[level];
+            const Vec3 o = (p - bounds.pMin)/(voxelSize*(1 << level)) - 0.5f;
+            const int x0 = (int)std::floor(o.x);
+            const int y0 = (int)std::floor(o.y);
+            const int z0 = (int)std::floor(o.z);
+            const float tx = o.x - x0;
+            const float ty = o.y - y0;
+            const float tz = o.z - z0;
+
+            float sum = 0.0f;
+            for(int k = 0; k < 8; k++) {
+                const int x = x0 + (k & 1);
+                const int y = y0 + ((k >> 1) & 1);
+                const int z = z0 + ((k >> 2) & 1);
+                if(x < 0 || y < 0 || z < 0 || x >= r || y >= r || z >= r) continue;
+                const float w = ((k & 1) ? tx : 1 - tx)*(((k >> 1) & 1) ? ty : 1 - ty)*(((k >> 2) & 1) ? tz : 1 - tz);
+                sum += w*grid[x + r*(y + r*z)];
+            }
+            return sum;
+        };
+
+        //linear between the two nearest levels
+        float sample(const Vec3& p, float lod) const {
+            lod = std::min(std::max(lod, 0.0f), (float)(levels.size() - 1));
+            const int l0 = (int)lod;
+            const int l1 = std::min(l0 + 1, (int)levels.size() - 1);
+            const float t = lod - l0;
+            const float s0 = sampleLevel(p, l0);
+            if(t == 0.0f || l0 == l1) return s0;
+            return (1 - t)*s0 + t*sampleLevel(p, l1);
+        };
+};
+#endif